@@ -0,0 +1,133 @@
+/* The MIT License (MIT)
+
+   Copyright (c) 2023 Anrui Liu <liuar6@gmail.com>
+
+   Permission is hereby granted, free of charge, to any person obtaining
+   a copy of this software and associated documentation files (the
+   “Software”), to deal in the Software without restriction, including
+   without limitation the rights to use, copy, modify, merge, publish,
+   distribute, sublicense, and/or sell copies of the Software, and to
+   permit persons to whom the Software is furnished to do so, subject to
+   the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND,
+   EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+   NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+   BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+   ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#include "arena.h"
+
+arena_t *arena_init(size_t item_size, size_t slab_size){
+    /* items are kept 64 bytes aligned, a slab holds at least one item */
+    arena_t *a = calloc(1, sizeof(arena_t));
+    if (item_size < sizeof(void *)) item_size = sizeof(void *);
+    a->item_size = (item_size + 63u) & ~(size_t) 63u;
+    if (slab_size < a->item_size) slab_size = a->item_size;
+    a->slab_size = slab_size / a->item_size * a->item_size;
+    pthread_mutex_init(&a->m, NULL);
+    return a;
+}
+
+static int arena_grow(arena_t *a){
+    arena_slab_t *slab = malloc(sizeof(arena_slab_t));
+    slab->size = a->slab_size;
+    slab->mapped = 1;
+    slab->base = mmap(NULL, slab->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (slab->base == MAP_FAILED) {
+        slab->mapped = 0;
+        slab->base = calloc(1, slab->size);
+        if (!slab->base) {
+            free(slab);
+            return -1;
+        }
+    }
+    slab->next = a->slabs;
+    a->slabs = slab;
+    a->cursor = slab->base;
+    a->limit = a->cursor + slab->size;
+    return 0;
+}
+
+void *arena_alloc(arena_t *a){
+    /* fresh memory of a slab is already zero, recycled items are cleared outside the lock */
+    void *p = NULL;
+    int recycled = 0;
+    pthread_mutex_lock(&a->m);
+    if (a->recycled) {
+        p = a->recycled;
+        a->recycled = *(void **) p;
+        recycled = 1;
+    } else if (a->cursor < a->limit || arena_grow(a) == 0) {
+        p = a->cursor;
+        a->cursor += a->item_size;
+    }
+    if (p && ++a->n_used > a->n_used_max) a->n_used_max = a->n_used;
+    pthread_mutex_unlock(&a->m);
+    if (recycled) memset(p, 0, a->item_size);
+    return p;
+}
+
+void arena_free(arena_t *a, void *p){
+    if (!p) return;
+    pthread_mutex_lock(&a->m);
+    *(void **) p = a->recycled;
+    a->recycled = p;
+    a->n_used--;
+    pthread_mutex_unlock(&a->m);
+}
+
+size_t arena_high_water(arena_t *a){
+    /* the largest number of bytes held by live items so far */
+    return a->n_used_max * a->item_size;
+}
+
+int arena_adopt(arena_t *a, arena_t *from){
+    /* move the slabs and the live items of from, which has the same item size, into a and destroy from.
+     * the high water marks are added, which bounds the peak of both. */
+    pthread_mutex_lock(&a->m);
+    if (from->slabs) {
+        arena_slab_t *slab = from->slabs;
+        while (slab->next) slab = slab->next;
+        slab->next = a->slabs;
+        a->slabs = from->slabs;
+    }
+    if (from->recycled) {
+        void *p = from->recycled;
+        while (*(void **) p) p = *(void **) p;
+        *(void **) p = a->recycled;
+        a->recycled = from->recycled;
+    }
+    a->n_used += from->n_used;
+    a->n_used_max += from->n_used_max;
+    pthread_mutex_unlock(&a->m);
+    pthread_mutex_destroy(&from->m);
+    free(from);
+    return 0;
+}
+
+int arena_destroy(arena_t *a){
+    arena_slab_t *slab = a->slabs, *next;
+    while (slab) {
+        next = slab->next;
+        if (slab->mapped) munmap(slab->base, slab->size);
+        else free(slab->base);
+        free(slab);
+        slab = next;
+    }
+    pthread_mutex_destroy(&a->m);
+    free(a);
+    return 0;
+}
@@ -0,0 +1,60 @@
+/* The MIT License (MIT)
+
+   Copyright (c) 2023 Anrui Liu <liuar6@gmail.com>
+
+   Permission is hereby granted, free of charge, to any person obtaining
+   a copy of this software and associated documentation files (the
+   “Software”), to deal in the Software without restriction, including
+   without limitation the rights to use, copy, modify, merge, publish,
+   distribute, sublicense, and/or sell copies of the Software, and to
+   permit persons to whom the Software is furnished to do so, subject to
+   the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND,
+   EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+   NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+   BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+   ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE.
+ */
+
+#ifndef SAMVT_ARENA_H
+#define SAMVT_ARENA_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+/* fixed size zeroed items carved from large mmap'd slabs. items can be given back for recycling, and all of
+ * them are released at once by arena_destroy. */
+typedef struct arena_slab_s{
+    void *base;
+    size_t size;
+    int mapped;
+    struct arena_slab_s *next;
+} arena_slab_t;
+
+typedef struct arena_s{
+    size_t item_size;
+    size_t slab_size;
+    arena_slab_t *slabs;
+    char *cursor;
+    char *limit;
+    void *recycled;
+    size_t n_used;
+    size_t n_used_max;
+    pthread_mutex_t m;
+} arena_t;
+
+arena_t *arena_init(size_t item_size, size_t slab_size);
+void *arena_alloc(arena_t *a);
+void arena_free(arena_t *a, void *p);
+size_t arena_high_water(arena_t *a);
+int arena_adopt(arena_t *a, arena_t *from);
+int arena_destroy(arena_t *a);
+
+#endif //SAMVT_ARENA_H
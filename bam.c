@@ -23,21 +23,128 @@
    SOFTWARE.
  */
 
+#include <stdio.h>
+
+#include "htslib/hfile.h"
+#include "htslib/kstring.h"
+#include "khash.h"
 #include "bam.h"
 
+KHASH_MAP_INIT_STR(pair, uint64_t)
+
+/* the records waiting for their mates, in the order of reading. a record is kept in ring[seq & (m_ring - 1)], where
+ * seq counts the records stored so far, and the hash maps its qname to seq. the slots of the paired records are
+ * left empty until the head moves past them. */
+typedef struct bt_pair_s{
+    khash_t(pair) *h;
+    bam1_t **ring;
+    uint32_t m_ring;
+    uint64_t head;
+    uint64_t tail;
+    uint64_t drain; /* the records before it are handed out as orphans */
+    bam1_t **pool;
+    int n_pool;
+    int m_pool;
+    bam1_t *held; /* the record read while the orphans are handed out */
+    int32_t tid; /* the last record read */
+    hts_pos_t pos;
+    int unsorted; /* a record was read before the one read ahead of it */
+    int eof;
+    size_t n_held;
+    bt_pair_stat_t stat;
+} bt_pair_t;
+
+static bt_pair_t *bt_pair_init(){
+    bt_pair_t *p = calloc(1, sizeof(bt_pair_t));
+    p->h = kh_init(pair);
+    p->m_ring = 1024;
+    p->ring = calloc(p->m_ring, sizeof(bam1_t *));
+    p->tid = INT32_MIN;
+    return p;
+}
+
+static void bt_pair_destroy(bt_pair_t *p){
+    for (uint64_t i = p->head; i < p->tail; ++i) if (p->ring[i & (p->m_ring - 1)]) bam_destroy1(p->ring[i & (p->m_ring - 1)]);
+    for (int i = 0; i < p->n_pool; ++i) bam_destroy1(p->pool[i]);
+    if (p->held) bam_destroy1(p->held);
+    kh_destroy(pair, p->h);
+    free(p->ring);
+    free(p->pool);
+    free(p);
+}
+
+static bam1_t *bt_pair_get(bt_pair_t *p){
+    return p->n_pool ? p->pool[--p->n_pool] : bam_init1();
+}
+
+static void bt_pair_put(bt_pair_t *p, bam1_t *b){
+    if (p->n_pool == p->m_pool) {
+        p->m_pool = p->m_pool ? p->m_pool * 2 : 64;
+        p->pool = realloc(p->pool, p->m_pool * sizeof(bam1_t *));
+    }
+    p->pool[p->n_pool++] = b;
+}
+
+static bam1_t *bt_pair_take(bt_pair_t *p, uint64_t seq){
+    /* remove the record seq from the ring and the hash */
+    bam1_t *b = p->ring[seq & (p->m_ring - 1)];
+    khiter_t k = kh_get(pair, p->h, bam_get_qname(b));
+    if (k != kh_end(p->h) && kh_val(p->h, k) == seq) kh_del(pair, p->h, k);
+    p->ring[seq & (p->m_ring - 1)] = NULL;
+    p->n_held--;
+    while (p->head < p->tail && !p->ring[p->head & (p->m_ring - 1)]) p->head++;
+    return b;
+}
+
+static void bt_pair_store(bt_pair_t *p, bam1_t *b){
+    /* the ring is doubled when full, which keeps the slot of each seq */
+    if (p->tail - p->head == p->m_ring) {
+        bam1_t **ring = calloc(p->m_ring * 2, sizeof(bam1_t *));
+        for (uint64_t i = p->head; i < p->tail; ++i) ring[i & (p->m_ring * 2 - 1)] = p->ring[i & (p->m_ring - 1)];
+        free(p->ring);
+        p->ring = ring;
+        p->m_ring *= 2;
+    }
+    int ret;
+    khiter_t k = kh_put(pair, p->h, bam_get_qname(b), &ret);
+    kh_key(p->h, k) = bam_get_qname(b); /* a record with the same name may still be in the ring */
+    kh_val(p->h, k) = p->tail;
+    p->ring[p->tail++ & (p->m_ring - 1)] = b;
+    if (++p->n_held > p->stat.high_water) p->stat.high_water = p->n_held;
+}
+
 bt_bam_t *bt_bam_open(const char* fn, int n_threads){
     bt_bam_t *s = malloc(sizeof(bt_bam_t));
     s->fn = strdup(fn);
     s->fp = sam_open(fn, "r");
     s->s = NULL;
+    s->idx = NULL;
+    s->itr = NULL;
+    s->pending = NULL;
+    s->n_pending = 0;
+    s->i_pending = 0;
+    s->pair = NULL;
+    s->pair_buffer = BT_PAIR_BUFFER;
+    s->carry = NULL;
+    s->n_carry = 0;
+    s->m_carry = 0;
     if (s->fp->is_bgzf) bgzf_mt(s->fp->fp.bgzf, n_threads, 128);
     else s->s = mt_server_init(n_threads);
     s->hdr = sam_hdr_read(s->fp);
+    /* the threads parsing sam lines share this header and only read it, htslib builds its name lookup on
+     * the first query, so make that query here before any worker can race on it */
+    if (s->hdr && s->hdr->n_targets) bam_name2id(s->hdr, s->hdr->target_name[0]);
     return s;
 }
 
 int bt_bam_close(bt_bam_t *s) {
     free(s->fn);
+    if (s->itr) hts_itr_destroy(s->itr);
+    if (s->idx) hts_idx_destroy(s->idx);
+    for (int i = s->i_pending; i < s->n_pending; ++i) bam_destroy1(s->pending[i]);
+    free(s->pending);
+    if (s->pair) bt_pair_destroy(s->pair);
+    free(s->carry);
     bam_hdr_destroy(s->hdr);
     sam_close(s->fp);
     if (s->s) mt_server_destroy(s->s);
@@ -45,17 +152,636 @@ int bt_bam_close(bt_bam_t *s) {
     return 0;
 }
 
+static void bt_bam_swap(bam1_t *a, bam1_t *b){
+    /* hand a record out without copying its data, the record of the caller takes its place */
+    bam1_t t = *a;
+    *a = *b;
+    *b = t;
+}
+
 int bt_bam_next(bt_bam_t *s, bam1_t *b) {
+    if (s->i_pending < s->n_pending) {
+        /* the records read ahead by bt_bam_sample_span come first */
+        bt_bam_swap(b, s->pending[s->i_pending]);
+        bam_destroy1(s->pending[s->i_pending++]);
+        return 0;
+    }
+    if (s->itr) return sam_itr_next(s->fp, s->itr, b) >= 0 ? 0 : -1;
     if (sam_read1(s->fp, s->hdr, b) >= 0) return 0;
     else return -1;
 }
 
+bt_bam_t *bt_bam_set_pair_buffer(bt_bam_t *s, uint32_t n) {
+    s->pair_buffer = n ? n : 1;
+    return s;
+}
+
 int bt_bam_next2(bt_bam_t *s, bam1_t *b1, bam1_t *b2) {
-    /* each time, return the pair end records */
+    /* returns 0 with the two mates of a pair in b1 and b2, in the order of reading, 1 with a record going alone in
+     * b1 and -1 at the end. the input should be sorted by coordinate: a record waits for its mate only if the mate
+     * lies on the same target and not before it. the records left waiting are handed out alone once their target
+     * ends, or once the buffer holds s->pair_buffer records in the span between the oldest and the newest. */
+    if (!s->pair) s->pair = bt_pair_init();
+    bt_pair_t *p = s->pair;
+    for (;;) {
+        if (p->head < p->drain) {
+            bam1_t *b = bt_pair_take(p, p->head);
+            bt_bam_swap(b1, b);
+            bt_pair_put(p, b);
+            p->stat.n_orphans++;
+            return 1;
+        }
+        bam1_t *b = p->held;
+        p->held = NULL;
+        if (!b) {
+            if (p->eof) return -1;
+            b = bt_pair_get(p);
+            if (bt_bam_next(s, b) < 0) {
+                bt_pair_put(p, b);
+                p->eof = 1;
+                p->drain = p->tail;
+                continue;
+            }
+            if (p->tid != INT32_MIN && ((uint32_t) b->core.tid < (uint32_t) p->tid || (b->core.tid == p->tid && b->core.pos < p->pos)))
+                p->unsorted = 1; /* unmapped reads at the end have tid -1 */
+            int new_tid = b->core.tid != p->tid;
+            p->tid = b->core.tid;
+            p->pos = b->core.pos;
+            if (new_tid) {
+                p->held = b;
+                p->drain = p->tail;
+                continue;
+            }
+        }
+        bam1_core_t *c = &b->core;
+        if (!(c->flag & BAM_FPAIRED) || (c->flag & (BAM_FSECONDARY | BAM_FSUPPLEMENTARY)) || c->mtid != c->tid) {
+            bt_bam_swap(b1, b);
+            bt_pair_put(p, b);
+            p->stat.n_singles++;
+            return 1;
+        }
+        khiter_t k = kh_get(pair, p->h, bam_get_qname(b));
+        if (k != kh_end(p->h)) {
+            bam1_t *mate = bt_pair_take(p, kh_val(p->h, k));
+            bt_bam_swap(b1, mate);
+            bt_bam_swap(b2, b);
+            bt_pair_put(p, mate);
+            bt_pair_put(p, b);
+            p->stat.n_pairs++;
+            return 0;
+        }
+        if (c->mpos < c->pos) {
+            /* the mate was left out or handed out already */
+            bt_bam_swap(b1, b);
+            bt_pair_put(p, b);
+            p->stat.n_orphans++;
+            return 1;
+        }
+        if (p->tail - p->head >= s->pair_buffer) {
+            p->held = b;
+            p->drain = p->head + 1;
+            continue;
+        }
+        bt_pair_store(p, b);
+    }
+}
+
+int bt_bam_pair_frontier(bt_bam_t *s, int32_t *tid, hts_pos_t *pos) {
+    /* the records handed out by bt_bam_next2 from now on start at or after (tid, pos), returns -1 before the first
+     * record is read */
+    bt_pair_t *p = s->pair;
+    if (!p || p->tid == INT32_MIN) return -1;
+    bam1_t *b = p->head < p->tail ? p->ring[p->head & (p->m_ring - 1)] : p->held;
+    *tid = b ? b->core.tid : p->tid;
+    *pos = b ? b->core.pos : p->pos;
     return 0;
 }
 
+int bt_bam_pair_sorted(bt_bam_t *s) {
+    /* whether every record read so far by bt_bam_next2, handed out or still waiting, came in coordinate order */
+    return !s->pair || !s->pair->unsorted;
+}
+
+bt_pair_stat_t bt_bam_pair_stat(bt_bam_t *s) {
+    bt_pair_stat_t stat = {0, 0, 0, 0};
+    return s->pair ? s->pair->stat : stat;
+}
+
+int bt_bam_sorted(bt_bam_t *s) {
+    /* whether the @HD line declares SO:coordinate */
+    char *text = s->hdr->text;
+    if (!text || s->hdr->l_text < 3 || strncmp(text, "@HD", 3) != 0) return 0;
+    char *end = memchr(text, '\n', s->hdr->l_text);
+    if (!end) end = text + s->hdr->l_text;
+    for (char *p = text; p + 14 <= end; ++p)
+        if (strncmp(p, "\tSO:coordinate", 14) == 0) return 1;
+    return 0;
+}
+
+uint32_t bt_bam_sample_span(bt_bam_t *s, int n) {
+    /* read ahead up to n records and return the mean reference span of the mapped ones, the records are
+     * still returned by bt_bam_next afterwards */
+    uint64_t span = 0, n_mapped = 0;
+    s->pending = realloc(s->pending, n * sizeof(bam1_t *));
+    s->n_pending = 0;
+    s->i_pending = 0;
+    while (s->n_pending < n) {
+        bam1_t *b = bam_init1();
+        if (sam_read1(s->fp, s->hdr, b) < 0) {
+            bam_destroy1(b);
+            break;
+        }
+        s->pending[s->n_pending++] = b;
+        if (b->core.flag & BAM_FUNMAP) continue;
+        span += bam_endpos(b) - b->core.pos;
+        n_mapped++;
+    }
+    return n_mapped ? span / n_mapped : 0;
+}
+
+int bt_bam_index(bt_bam_t *s) {
+    /* load the .bai/.csi index next to the file, returns -1 if there is none */
+    if (!s->idx) s->idx = sam_index_load(s->fp, s->fn);
+    return s->idx ? 0 : -1;
+}
+
+int bt_bam_query(bt_bam_t *s, bt_region_t *r) {
+    /* after this, bt_bam_next only returns the records overlapping r, the records read ahead are dropped */
+    for (; s->i_pending < s->n_pending; ++s->i_pending) bam_destroy1(s->pending[s->i_pending]);
+    if (s->itr) hts_itr_destroy(s->itr);
+    s->n_carry = 0;
+    s->itr = sam_itr_queryi(s->idx, r->tid, r->beg, r->end);
+    return s->itr ? 0 : -1;
+}
+
+bt_region_t *bt_bam_split(bt_bam_t *s, uint32_t align, int n, int *n_region) {
+    /* cut the targets into about n regions holding similar numbers of mapped reads, the boundaries are multiples
+     * of align and the targets without mapped read are left out */
+    int32_t n_targets = s->hdr->n_targets;
+    double *weight = malloc(n_targets * sizeof(double));
+    double total = 0;
+    int m = 0;
+    for (int32_t i = 0; i < n_targets; ++i){
+        uint64_t mapped, unmapped;
+        if (hts_idx_get_stat(s->idx, i, &mapped, &unmapped) < 0) weight[i] = s->hdr->target_len[i];
+        else weight[i] = (double) mapped;
+        total += weight[i];
+    }
+    bt_region_t *r = NULL;
+    *n_region = 0;
+    for (int32_t i = 0; i < n_targets; ++i){
+        if (weight[i] == 0) continue;
+        hts_pos_t len = s->hdr->target_len[i];
+        hts_pos_t n_align = (len - 1) / align + 1;
+        hts_pos_t k = (hts_pos_t) (weight[i] / total * n + 0.5);
+        if (k < 1) k = 1;
+        if (k > n_align) k = n_align;
+        hts_pos_t step = ((n_align - 1) / k + 1) * align;
+        for (hts_pos_t beg = 0; beg < len; beg += step){
+            if (*n_region == m) {
+                m = m ? m * 2 : 64;
+                r = realloc(r, m * sizeof(bt_region_t));
+            }
+            r[*n_region].tid = i;
+            r[*n_region].beg = beg;
+            r[*n_region].end = beg + step < len ? beg + step : len;
+            (*n_region)++;
+        }
+    }
+    free(weight);
+    return r;
+}
+
 mt_server *bt_bam_mt_server(bt_bam_t *s) {
     if (s->fp->is_bgzf) return (mt_server *) s->fp->fp.bgzf->mt->pool;
     else return s->s;
-}
\ No newline at end of file
+}
+static inline uint32_t bt_le32(const uint8_t *p){
+    return p[0] | (uint32_t) p[1] << 8u | (uint32_t) p[2] << 16u | (uint32_t) p[3] << 24u;
+}
+
+static inline uint16_t bt_le16(const uint8_t *p){
+    return p[0] | (uint16_t) (p[1] << 8u);
+}
+
+static inline void bt_put_le32(uint8_t *p, uint32_t v){
+    p[0] = v;
+    p[1] = v >> 8u;
+    p[2] = v >> 16u;
+    p[3] = v >> 24u;
+}
+
+static inline void bt_put_le16(uint8_t *p, uint16_t v){
+    p[0] = v;
+    p[1] = v >> 8u;
+}
+
+static void bt_chunk_reserve(bt_chunk_t *c, size_t size){
+    if (c->m_data >= size) return;
+    c->m_data = size;
+    c->data = realloc(c->data, c->m_data);
+}
+
+static void bt_chunk_pack(bt_chunk_t *c, bam1_t *b){
+    /* append b in the layout of the bam file, without the padding of its name */
+    uint32_t l_qname = b->core.l_qname - b->core.l_extranul;
+    uint32_t block_size = 32 + l_qname + b->l_data - b->core.l_qname;
+    if (c->size + 4 + block_size > c->m_data) bt_chunk_reserve(c, (c->size + 4 + block_size) * 2);
+    uint8_t *p = c->data + c->size;
+    bt_put_le32(p, block_size);
+    bt_put_le32(p + 4, b->core.tid);
+    bt_put_le32(p + 8, b->core.pos);
+    p[12] = l_qname;
+    p[13] = b->core.qual;
+    bt_put_le16(p + 14, b->core.bin);
+    bt_put_le16(p + 16, b->core.n_cigar);
+    bt_put_le16(p + 18, b->core.flag);
+    bt_put_le32(p + 20, b->core.l_qseq);
+    bt_put_le32(p + 24, b->core.mtid);
+    bt_put_le32(p + 28, b->core.mpos);
+    bt_put_le32(p + 32, b->core.isize);
+    memcpy(p + 36, b->data, l_qname);
+    memcpy(p + 36 + l_qname, b->data + b->core.l_qname, b->l_data - b->core.l_qname);
+    c->size += 4 + block_size;
+}
+
+static void bt_chunk_append(bt_chunk_t *c, const char *line, size_t l){
+    /* append a line of sam and its newline */
+    if (c->size + l + 1 > c->m_data) bt_chunk_reserve(c, (c->size + l + 1) * 2);
+    memcpy(c->data + c->size, line, l);
+    c->data[c->size + l] = '\n';
+    c->size += l + 1;
+}
+
+static void bt_chunk_line(bt_chunk_t *c, size_t offset, kstring_t *str, bam1_t *b){
+    /* parse a copy of the line at offset into b, the lines themselves are parsed in place by the workers */
+    const char *p = (const char *) c->data + offset, *q = memchr(p, '\n', c->size - offset);
+    str->l = 0;
+    kputsn(p, q - p, str);
+    if (str->l && str->s[str->l - 1] == '\r') str->s[--str->l] = '\0';
+    if (sam_parse1(str, c->hdr, b) < 0) {
+        fprintf(stderr, "[bt_bam] failed to parse the sam line: %s\n", str->s);
+        exit(1);
+    }
+}
+
+static const uint8_t *bt_record_cg(const uint8_t *p, uint32_t *n_cigar){
+    /* a record with more than 65535 cigar operations keeps a placeholder cigar of kS mN, where k is the length of its
+     * sequence, and the real one in the CG tag. returns the operations of the CG tag and sets n_cigar, or NULL */
+    uint8_t l_qname = p[12];
+    uint32_t n = bt_le16(p + 16);
+    int32_t l_qseq = (int32_t) bt_le32(p + 20);
+    const uint8_t *cigar = p + 36 + l_qname, *end = p + 4 + bt_le32(p);
+    if (n != 2 || bam_cigar_op(bt_le32(cigar)) != BAM_CSOFT_CLIP || bam_cigar_oplen(bt_le32(cigar)) != (uint32_t) l_qseq
+        || bam_cigar_op(bt_le32(cigar + 4)) != BAM_CREF_SKIP) return NULL;
+    const uint8_t *q = cigar + 8 + (l_qseq + 1) / 2 + l_qseq;
+    while (q + 3 <= end) {
+        int is_cg = q[0] == 'C' && q[1] == 'G';
+        char type = q[2];
+        q += 3;
+        size_t size;
+        switch (type) {
+            case 'A': case 'c': case 'C': size = 1; break;
+            case 's': case 'S': size = 2; break;
+            case 'i': case 'I': case 'f': size = 4; break;
+            case 'Z': case 'H':
+                q = memchr(q, '\0', end - q);
+                if (!q) return NULL;
+                q++;
+                continue;
+            case 'B':
+                if (q + 5 > end) return NULL;
+                size = q[0] == 'c' || q[0] == 'C' ? 1 : q[0] == 's' || q[0] == 'S' ? 2 : 4;
+                if (is_cg && q[0] == 'I' && q + 5 + (size_t) bt_le32(q + 1) * 4 <= end) {
+                    *n_cigar = bt_le32(q + 1);
+                    return q + 5;
+                }
+                size = 5 + size * bt_le32(q + 1);
+                break;
+            default:
+                return NULL;
+        }
+        q += size;
+    }
+    return NULL;
+}
+
+static hts_pos_t bt_record_endpos(const uint8_t *p){
+    /* the same as bam_endpos, for a record in its binary form */
+    uint32_t n_cigar = bt_le16(p + 16);
+    const uint8_t *cigar = bt_record_cg(p, &n_cigar);
+    if (!cigar) cigar = p + 36 + p[12];
+    hts_pos_t beg = (int32_t) bt_le32(p + 8), pos = beg;
+    int consumed = 0;
+    for (uint32_t k = 0; k < n_cigar; ++k) {
+        uint32_t op = bt_le32(cigar + k * 4);
+        if (!(bam_cigar_type(bam_cigar_op(op)) & 2)) continue;
+        pos += bam_cigar_oplen(op);
+        consumed = 1;
+    }
+    return (bt_le16(p + 18) & BAM_FUNMAP) || !consumed ? beg + 1 : pos;
+}
+
+static ssize_t bt_bam_read_raw(bt_bam_t *s, void *data, size_t length) {
+    /* plain sam is read through hfile by htslib, anything compressed through bgzf */
+    if (s->fp->is_bgzf) return bgzf_read(s->fp->fp.bgzf, data, length);
+    return hread(s->fp->fp.hfile, data, length);
+}
+
+int bt_bam_chunked(bt_bam_t *s) {
+    /* whether the records can be read by chunks: a bam file on a little-endian host, read from the start or through
+     * the index after bt_bam_query, or a sam file read from the start */
+    const uint16_t one = 1;
+    if (s->fp->format.format == bam && *(const uint8_t *) &one == 1) return 1;
+    return !s->itr && s->fp->format.format == sam;
+}
+
+static int bt_bam_read_itr(bt_bam_t *s, bt_chunk_t *c, size_t size) {
+    /* the raw records of the region of bt_bam_query, walking the chunks of the index like hts_itr_next does. only
+     * the records overlapping the region are kept */
+    hts_itr_t *itr = s->itr;
+    BGZF *fp = s->fp->fp.bgzf;
+    size_t last = 0;
+    bt_chunk_reserve(c, size);
+    c->size = 0;
+    c->hdr = NULL;
+    c->n = 0;
+    while (!itr->finished && c->size < size) {
+        if (itr->curr_off == 0 || itr->curr_off >= itr->off[itr->i].v) {
+            /* jump to the next chunk, the adjacent ones are read on */
+            if (itr->i == itr->n_off - 1) {
+                itr->finished = 1;
+                break;
+            }
+            if (itr->i < 0 || itr->off[itr->i].v != itr->off[itr->i + 1].u) {
+                if (bgzf_seek(fp, itr->off[itr->i + 1].u, SEEK_SET) < 0) {
+                    fprintf(stderr, "[bt_bam] failed to seek in %s.\n", s->fn);
+                    exit(1);
+                }
+                itr->curr_off = bgzf_tell(fp);
+            }
+            ++itr->i;
+        }
+        uint8_t l[4];
+        ssize_t n = bgzf_read(fp, l, 4);
+        if (n == 0) {
+            itr->finished = 1;
+            break;
+        }
+        uint32_t block_size = n == 4 ? bt_le32(l) : 0;
+        if (block_size < 32) {
+            fprintf(stderr, "[bt_bam] failed to read %s.\n", s->fn);
+            exit(1);
+        }
+        if (c->size + 4 + block_size > c->m_data) bt_chunk_reserve(c, (c->size + 4 + block_size) * 2);
+        uint8_t *p = c->data + c->size;
+        memcpy(p, l, 4);
+        if (bgzf_read(fp, p + 4, block_size) != (ssize_t) block_size) {
+            fprintf(stderr, "[bt_bam] %s is truncated.\n", s->fn);
+            exit(1);
+        }
+        itr->curr_off = bgzf_tell(fp);
+        if ((int32_t) bt_le32(p + 4) != itr->tid || (int32_t) bt_le32(p + 8) >= itr->end) {
+            /* the records are sorted, nothing after this one can overlap */
+            itr->finished = 1;
+            break;
+        }
+        if (bt_record_endpos(p) <= itr->beg) continue;
+        last = c->size;
+        c->size += 4 + block_size;
+        c->n++;
+    }
+    if (!c->n) return -1;
+    c->tid = (int32_t) bt_le32(c->data + 4);
+    c->pos = (int32_t) bt_le32(c->data + 8);
+    c->last_tid = (int32_t) bt_le32(c->data + last + 4);
+    c->last_pos = (int32_t) bt_le32(c->data + last + 8);
+    return 0;
+}
+
+int bt_bam_read_chunk(bt_bam_t *s, bt_chunk_t *c, size_t size) {
+    /* read about size bytes of records, returns -1 at the end. the decompression is left to the threads of bgzf_mt,
+     * here only the length of each record is looked at, and the record cut at the end of the data is carried over
+     * to the next chunk. for sam, the chunk holds whole lines, which are only parsed by bt_batch_push_chunk. the
+     * records read ahead by bt_bam_sample_span come first. after bt_bam_query, the records of its region are read */
+    if (s->itr) return bt_bam_read_itr(s, c, size);
+    int text = s->fp->format.format == sam;
+    bt_chunk_reserve(c, size);
+    c->size = 0;
+    c->hdr = text ? s->hdr : NULL;
+    kstring_t str = {0, 0, NULL};
+    for (; s->i_pending < s->n_pending; ++s->i_pending) {
+        if (text) {
+            str.l = 0;
+            sam_format1(s->hdr, s->pending[s->i_pending], &str);
+            bt_chunk_append(c, str.s, str.l);
+        } else bt_chunk_pack(c, s->pending[s->i_pending]);
+        bam_destroy1(s->pending[s->i_pending]);
+    }
+    if (text && s->fp->line.l) {
+        /* the first record, read by sam_hdr_read while looking for the end of the header */
+        bt_chunk_append(c, s->fp->line.s, s->fp->line.l);
+        s->fp->line.l = 0;
+    }
+    if (s->n_carry) {
+        bt_chunk_reserve(c, c->size + s->n_carry);
+        memcpy(c->data + c->size, s->carry, s->n_carry);
+        c->size += s->n_carry;
+    }
+    size_t offset = 0, last = 0;
+    int eof = 0;
+    c->n = 0;
+    for (;;) {
+        if (c->size < c->m_data) {
+            ssize_t n = bt_bam_read_raw(s, c->data + c->size, c->m_data - c->size);
+            if (n < 0) {
+                fprintf(stderr, "[bt_bam] failed to read %s.\n", s->fn);
+                exit(1);
+            }
+            eof = n == 0; /* a pipe may return less before the end */
+            c->size += n;
+        }
+        if (text) {
+            /* the last line may miss its newline */
+            if (eof && c->size > offset && c->data[c->size - 1] != '\n') {
+                bt_chunk_reserve(c, c->size + 1);
+                c->data[c->size++] = '\n';
+            }
+            uint8_t *q;
+            while ((q = memchr(c->data + offset, '\n', c->size - offset))) {
+                if (q > c->data + offset) {
+                    last = offset;
+                    c->n++;
+                }
+                offset = q - c->data + 1;
+            }
+        } else while (offset + 4 <= c->size && offset + 4 + bt_le32(c->data + offset) <= c->size) {
+            last = offset;
+            offset += 4 + bt_le32(c->data + offset);
+            c->n++;
+        }
+        if (c->n || eof) break;
+        if (c->size == c->m_data) bt_chunk_reserve(c, c->m_data * 2); /* a record longer than the chunk */
+    }
+    s->n_carry = c->size - offset;
+    if (s->n_carry > s->m_carry) {
+        s->m_carry = s->n_carry;
+        s->carry = realloc(s->carry, s->m_carry);
+    }
+    if (s->n_carry) memcpy(s->carry, c->data + offset, s->n_carry);
+    if (eof && s->n_carry) {
+        fprintf(stderr, "[bt_bam] %s is truncated.\n", s->fn);
+        s->n_carry = 0;
+    }
+    c->size = offset;
+    if (!c->n) {
+        free(str.s);
+        return -1;
+    }
+    if (text) {
+        /* the first and the last records are parsed here for the order of the chunks */
+        size_t first = 0;
+        while (c->data[first] == '\n') first++;
+        bam1_t *b = bam_init1();
+        bt_chunk_line(c, first, &str, b);
+        c->tid = b->core.tid;
+        c->pos = b->core.pos;
+        bt_chunk_line(c, last, &str, b);
+        c->last_tid = b->core.tid;
+        c->last_pos = b->core.pos;
+        bam_destroy1(b);
+        free(str.s);
+        return 0;
+    }
+    free(str.s);
+    c->tid = (int32_t) bt_le32(c->data + 4);
+    c->pos = (int32_t) bt_le32(c->data + 8);
+    c->last_tid = (int32_t) bt_le32(c->data + last + 4);
+    c->last_pos = (int32_t) bt_le32(c->data + last + 8);
+    return 0;
+}
+
+bt_batch_t *bt_batch_init(int with_seq) {
+    bt_batch_t *t = calloc(1, sizeof(bt_batch_t));
+    t->with_seq = with_seq;
+    return t;
+}
+
+void bt_batch_destroy(bt_batch_t *t) {
+    free(t->tid);
+    free(t->pos);
+    free(t->flag);
+    free(t->n_cigar);
+    free(t->cigar_offset);
+    free(t->seq_offset);
+    free(t->cigar);
+    free(t->seq);
+    free(t);
+}
+
+void bt_batch_clear(bt_batch_t *t) {
+    t->n = 0;
+    t->l_cigar = 0;
+    t->l_seq = 0;
+}
+
+static void bt_batch_reserve(bt_batch_t *t, uint32_t n_cigar, int32_t l_qseq) {
+    /* room for one more record */
+    if (t->n == t->m) {
+        t->m = t->m ? t->m * 2 : 1024;
+        t->tid = realloc(t->tid, t->m * sizeof(int32_t));
+        t->pos = realloc(t->pos, t->m * sizeof(hts_pos_t));
+        t->flag = realloc(t->flag, t->m * sizeof(uint16_t));
+        t->n_cigar = realloc(t->n_cigar, t->m * sizeof(uint32_t));
+        t->cigar_offset = realloc(t->cigar_offset, t->m * sizeof(size_t));
+        t->seq_offset = realloc(t->seq_offset, t->m * sizeof(size_t));
+    }
+    if (t->l_cigar + n_cigar > t->m_cigar) {
+        t->m_cigar = (t->l_cigar + n_cigar) * 2;
+        t->cigar = realloc(t->cigar, t->m_cigar * sizeof(uint32_t));
+    }
+    if (t->with_seq && t->l_seq + (l_qseq + 1) / 2 > t->m_seq) {
+        t->m_seq = (t->l_seq + (l_qseq + 1) / 2) * 2;
+        t->seq = realloc(t->seq, t->m_seq);
+    }
+}
+
+int bt_batch_push(bt_batch_t *t, bam1_t *b) {
+    bt_batch_reserve(t, b->core.n_cigar, b->core.l_qseq);
+    t->tid[t->n] = b->core.tid;
+    t->pos[t->n] = b->core.pos;
+    t->flag[t->n] = b->core.flag;
+    t->n_cigar[t->n] = b->core.n_cigar;
+    t->cigar_offset[t->n] = t->l_cigar;
+    memcpy(t->cigar + t->l_cigar, bam_get_cigar(b), b->core.n_cigar * sizeof(uint32_t));
+    t->l_cigar += b->core.n_cigar;
+    t->seq_offset[t->n] = t->l_seq;
+    if (t->with_seq) {
+        memcpy(t->seq + t->l_seq, bam_get_seq(b), (b->core.l_qseq + 1) / 2);
+        t->l_seq += (b->core.l_qseq + 1) / 2;
+    }
+    return t->n++;
+}
+
+static int bt_batch_push_lines(bt_batch_t *t, bt_chunk_t *c) {
+    /* parse the lines of c in place */
+    int n = t->n;
+    bam1_t *b = bam_init1();
+    char *p = (char *) c->data, *end = p + c->size;
+    while (p < end) {
+        char *q = memchr(p, '\n', end - p);
+        *q = '\0';
+        if (q > p && *(q - 1) == '\r') *(q - 1) = '\0';
+        kstring_t str = {strlen(p), q - p + 1, p};
+        p = q + 1;
+        if (!str.l) continue;
+        if (sam_parse1(&str, c->hdr, b) < 0) {
+            fprintf(stderr, "[bt_bam] failed to parse the sam line: %s\n", str.s);
+            exit(1);
+        }
+        bt_batch_push(t, b);
+    }
+    bam_destroy1(b);
+    return t->n - n;
+}
+
+int bt_batch_push_chunk(bt_batch_t *t, bt_chunk_t *c) {
+    /* decode the records of c straight from their binary form, returns the number of records added. the long cigars
+     * kept in the CG tag are expanded like sam_read1 does */
+    if (c->hdr) return bt_batch_push_lines(t, c);
+    int n = t->n;
+    for (size_t offset = 0; offset < c->size; offset += 4 + bt_le32(c->data + offset)) {
+        const uint8_t *p = c->data + offset;
+        uint8_t l_qname = p[12];
+        uint32_t n_cigar = bt_le16(p + 16), n_cg = 0;
+        int32_t l_qseq = (int32_t) bt_le32(p + 20);
+        const uint8_t *cg = bt_record_cg(p, &n_cg);
+        bt_batch_reserve(t, cg ? n_cg : n_cigar, l_qseq);
+        t->tid[t->n] = (int32_t) bt_le32(p + 4);
+        t->pos[t->n] = (int32_t) bt_le32(p + 8);
+        t->flag[t->n] = bt_le16(p + 18);
+        t->n_cigar[t->n] = cg ? n_cg : n_cigar;
+        t->cigar_offset[t->n] = t->l_cigar;
+        memcpy(t->cigar + t->l_cigar, cg ? cg : p + 36 + l_qname, t->n_cigar[t->n] * sizeof(uint32_t));
+        t->l_cigar += t->n_cigar[t->n];
+        t->seq_offset[t->n] = t->l_seq;
+        if (t->with_seq) {
+            memcpy(t->seq + t->l_seq, p + 36 + l_qname + n_cigar * 4, (l_qseq + 1) / 2);
+            t->l_seq += (l_qseq + 1) / 2;
+        }
+        t->n++;
+    }
+    return t->n - n;
+}
+
+hts_pos_t bt_read_endpos(const bt_read_t *r) {
+    /* the same as bam_endpos */
+    hts_pos_t pos = r->pos;
+    int consumed = 0;
+    for (uint32_t k = 0; k < r->n_cigar; ++k) {
+        if (!(bam_cigar_type(bam_cigar_op(r->cigar[k])) & 2)) continue;
+        pos += bam_cigar_oplen(r->cigar[k]);
+        consumed = 1;
+    }
+    return (r->flag & BAM_FUNMAP) || !consumed ? r->pos + 1 : pos;
+}
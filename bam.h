@@ -37,13 +37,115 @@ typedef struct bt_bam_s{
     samFile *fp;
     bam_hdr_t *hdr;
     mt_server *s;
+    hts_idx_t *idx;
+    hts_itr_t *itr;
+    bam1_t **pending;
+    int n_pending;
+    int i_pending;
+    struct bt_pair_s *pair;
+    uint32_t pair_buffer;
+    uint8_t *carry;
+    size_t n_carry;
+    size_t m_carry;
 } bt_bam_t;
 
+/* n whole bam records in their binary form, or n whole lines of sam when hdr is set, (tid, pos) and
+ * (last_tid, last_pos) are the first and the last of them */
+typedef struct bt_chunk_s{
+    uint8_t *data;
+    size_t size;
+    size_t m_data;
+    bam_hdr_t *hdr; /* shared by the parsing threads, read only and fully built by bt_bam_open */
+    int n;
+    int32_t tid;
+    hts_pos_t pos;
+    int32_t last_tid;
+    hts_pos_t last_pos;
+} bt_chunk_t;
+
+/* counters of bt_bam_next2. high_water is the most records held at once while waiting for their mates, orphans are
+ * the paired records whose mate was not found on the same target within the buffer */
+typedef struct bt_pair_stat_s{
+    uint64_t n_pairs;
+    uint64_t n_singles;
+    uint64_t n_orphans;
+    size_t high_water;
+} bt_pair_stat_t;
+
+#define BT_PAIR_BUFFER (1u<<20u)
+
+typedef struct bt_region_s{
+    int32_t tid;
+    hts_pos_t beg;
+    hts_pos_t end;
+} bt_region_t;
+
+/* the fields of a run of records used for counting, one array per field. the cigar of record i is n_cigar[i]
+ * operations from cigar + cigar_offset[i], and with with_seq, its packed sequence starts at seq + seq_offset[i].
+ * the name, the qualities and the tags are never copied */
+typedef struct bt_batch_s{
+    int n;
+    int m;
+    int with_seq;
+    int32_t *tid;
+    hts_pos_t *pos;
+    uint16_t *flag;
+    uint32_t *n_cigar;
+    size_t *cigar_offset;
+    size_t *seq_offset;
+    uint32_t *cigar;
+    size_t l_cigar;
+    size_t m_cigar;
+    uint8_t *seq;
+    size_t l_seq;
+    size_t m_seq;
+} bt_batch_t;
+
+#define bt_batch_cigar(t, i) ((t)->cigar + (t)->cigar_offset[i])
+#define bt_batch_seq(t, i) ((t)->seq + (t)->seq_offset[i])
+
+/* the fields of one record used for counting, pointing into a batch or straight into a bam1_t */
+typedef struct bt_read_s{
+    int32_t tid;
+    hts_pos_t pos;
+    uint16_t flag;
+    uint32_t n_cigar;
+    const uint32_t *cigar;
+    uint8_t *seq;
+} bt_read_t;
+
+static inline bt_read_t bt_read_batch(const bt_batch_t *t, int i){
+    bt_read_t r = {t->tid[i], t->pos[i], t->flag[i], t->n_cigar[i], bt_batch_cigar(t, i), t->with_seq ? bt_batch_seq(t, i) : NULL};
+    return r;
+}
+
+static inline bt_read_t bt_read_bam(const bam1_t *b){
+    bt_read_t r = {b->core.tid, b->core.pos, b->core.flag, b->core.n_cigar, bam_get_cigar(b), bam_get_seq(b)};
+    return r;
+}
+
 bt_bam_t *bt_bam_open(const char* fn, int n_threads);
 int bt_bam_close(bt_bam_t *s);
 int bt_bam_next(bt_bam_t *s, bam1_t *b);
 int bt_bam_next2(bt_bam_t *s, bam1_t *b1, bam1_t *b2);
+bt_bam_t *bt_bam_set_pair_buffer(bt_bam_t *s, uint32_t n);
+int bt_bam_pair_frontier(bt_bam_t *s, int32_t *tid, hts_pos_t *pos);
+int bt_bam_pair_sorted(bt_bam_t *s);
+bt_pair_stat_t bt_bam_pair_stat(bt_bam_t *s);
+int bt_bam_sorted(bt_bam_t *s);
+uint32_t bt_bam_sample_span(bt_bam_t *s, int n);
+int bt_bam_index(bt_bam_t *s);
+int bt_bam_query(bt_bam_t *s, bt_region_t *r);
+bt_region_t *bt_bam_split(bt_bam_t *s, uint32_t align, int n, int *n_region);
 mt_server *bt_bam_mt_server(bt_bam_t *s);
+int bt_bam_chunked(bt_bam_t *s);
+int bt_bam_read_chunk(bt_bam_t *s, bt_chunk_t *c, size_t size);
+bt_batch_t *bt_batch_init(int with_seq);
+void bt_batch_destroy(bt_batch_t *t);
+void bt_batch_clear(bt_batch_t *t);
+int bt_batch_push(bt_batch_t *t, bam1_t *b);
+int bt_batch_push_chunk(bt_batch_t *t, bt_chunk_t *c);
+hts_pos_t bt_read_endpos(const bt_read_t *r);
 
 
 #endif //SAMVT_SAM_H
@@ -29,6 +29,9 @@
 #include <stdlib.h>
 #include <getopt.h>
 #include <pthread.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #include "htslib/bgzf.h"
 #include "htslib/sam.h"
@@ -38,22 +41,168 @@
 #include "bam.h"
 #include "mt.h"
 #include "mt_buffer.h"
+#include "arena.h"
 #include "coverage.h"
 
-#define cov_val_t double
+/* nibbles other than A/C/G/T are counted as N */
+static const uint8_t base2index[16] = {4, 0, 1, 4, 2, 4, 4, 4, 3, 4, 4, 4, 4, 4, 4, 4};
+
+/* the 4 bits bases of a read are turned into channel indexes 16 or 32 at a time where the cpu allows, the
+ * vector loops only load the bytes holding the requested bases. */
+static void coverage_unpack_scalar(uint8_t *index, const uint8_t *read, int read_pos, uint32_t n){
+    for (uint32_t i = 0; i < n; ++i) index[i] = base2index[bam_seqi(read, read_pos + i)];
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+
+__attribute__((target("sse4.1")))
+static void coverage_unpack_sse41(uint8_t *index, const uint8_t *read, int read_pos, uint32_t n){
+    uint32_t i = 0;
+    if (read_pos & 1) index[i++] = base2index[bam_seqi(read, read_pos)];
+    const __m128i table = _mm_loadu_si128((const __m128i *) base2index);
+    const __m128i mask = _mm_set1_epi8(0x0f);
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadl_epi64((const __m128i *) (read + ((read_pos + i) >> 1)));
+        __m128i nibbles = _mm_unpacklo_epi8(_mm_and_si128(_mm_srli_epi16(v, 4), mask), _mm_and_si128(v, mask));
+        _mm_storeu_si128((__m128i *) (index + i), _mm_shuffle_epi8(table, nibbles));
+    }
+    for (; i < n; ++i) index[i] = base2index[bam_seqi(read, read_pos + i)];
+}
+
+__attribute__((target("avx2")))
+static void coverage_unpack_avx2(uint8_t *index, const uint8_t *read, int read_pos, uint32_t n){
+    uint32_t i = 0;
+    if (read_pos & 1) index[i++] = base2index[bam_seqi(read, read_pos)];
+    const __m256i table = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) base2index));
+    const __m128i mask = _mm_set1_epi8(0x0f);
+    for (; i + 32 <= n; i += 32) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (read + ((read_pos + i) >> 1)));
+        __m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), mask), lo = _mm_and_si128(v, mask);
+        __m256i nibbles = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_unpacklo_epi8(hi, lo)), _mm_unpackhi_epi8(hi, lo), 1);
+        _mm256_storeu_si256((__m256i *) (index + i), _mm256_shuffle_epi8(table, nibbles));
+    }
+    for (; i < n; ++i) index[i] = base2index[bam_seqi(read, read_pos + i)];
+}
+#endif
+
+static void (*coverage_unpack)(uint8_t *index, const uint8_t *read, int read_pos, uint32_t n) = coverage_unpack_scalar;
+
+static void coverage_unpack_select(void){
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) coverage_unpack = coverage_unpack_avx2;
+    else if (__builtin_cpu_supports("sse4.1")) coverage_unpack = coverage_unpack_sse41;
+#endif
+}
+
+#include "coverage_kernel.h"
+
+COVERAGE_KERNEL_INIT_ESCAPE(u16)
+COVERAGE_KERNEL_INIT_PLAIN(u32, uint32_t)
+COVERAGE_KERNEL_INIT_PLAIN(float, float)
+COVERAGE_KERNEL_INIT_PLAIN(double, double)
+
+static const coverage_kernel_t *coverage_kernel_select(int val_type){
+    switch (val_type) {
+        case COVERAGE_VAL_U16: return coverage_kernel(u16);
+        case COVERAGE_VAL_U32: return coverage_kernel(u32);
+        case COVERAGE_VAL_FLOAT: return coverage_kernel(float);
+        default: return coverage_kernel(double);
+    }
+}
+
+static int coverage_len_cmp(const void *a, const void *b){
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+uint32_t coverage_auto_block_shift(int32_t n_targets, uint32_t *target_len, uint32_t bin_size, uint32_t read_span){
+    /* a block should not be much longer than the typical (median) target, otherwise most of each block of a
+     * transcriptome is never touched, and it should be several times longer than a read, so that most reads
+     * stay inside one block. 4096 bins are never exceeded for the first reason only. */
+    uint32_t *len = malloc(n_targets * sizeof(uint32_t));
+    memcpy(len, target_len, n_targets * sizeof(uint32_t));
+    qsort(len, n_targets, sizeof(uint32_t), coverage_len_cmp);
+    uint64_t median = n_targets ? len[n_targets / 2] : 0;
+    free(len);
+    uint32_t shift = 6;
+    while (shift < 12 && ((uint64_t) bin_size << shift) < median) shift++;
+    while (shift < 16 && ((uint64_t) bin_size << shift) < (uint64_t) read_span * 8) shift++;
+    return shift;
+}
+
+uint32_t coverage_auto_mutex_shift(int32_t n_targets, uint32_t *target_len, uint32_t bin_size, uint32_t block_shift){
+    /* one mutex per block unless there would be more than 1<<18 of them (about 10 MB) */
+    uint64_t n_block = 0;
+    for (int32_t i = 0; i < n_targets; ++i) n_block += (((target_len[i] - 1) / bin_size) >> block_shift) + 1;
+    uint32_t shift = 0;
+    while ((n_block >> shift) > (1u << 18u)) shift++;
+    return shift;
+}
+
+int coverage_val_type(const char *name){
+    if (strcmp(name, "u16") == 0) return COVERAGE_VAL_U16;
+    else if (strcmp(name, "u32") == 0) return COVERAGE_VAL_U32;
+    else if (strcmp(name, "float") == 0) return COVERAGE_VAL_FLOAT;
+    else if (strcmp(name, "double") == 0) return COVERAGE_VAL_DOUBLE;
+    return -1;
+}
+
 typedef struct coverage_s{
     int32_t n_targets;
     char **target_name;
     uint32_t *target_len;
     uint32_t bin_size;
+    int bin_mode;
     uint32_t coverage_block_shift;
     uint32_t coverage_block_size;
-    cov_val_t ***coverage_blocks;
+    void ***coverage_blocks;
+    int16_t ***coverage_blocks_hi;
+    int val_type;
+    const coverage_kernel_t *kernel;
+    arena_t *arena;
+    arena_t *sparse_arena;
+    int mode;
     int is_mt;
     uint32_t coverage_mutex_shift;
     pthread_mutex_t **coverage_block_mutexes;
+    struct coverage_s *parent;
+    int n_shards;
+    struct coverage_s **shards;
+    mt_buffer *shard_pool;
+    size_t shard_mem;
+    size_t shard_mem_limit;
 } coverage_t;
 
+/* the blocks are carved from slabs of this size */
+#define COVERAGE_ARENA_SLAB (16u<<20u)
+
+/* in COVERAGE_MODE_DIFF a block starts as a short list of boundaries and only becomes the dense array once the
+ * list is full, so that a block touched by a few reads costs a few hundred bytes and is written out as runs.
+ * such blocks are tagged by the lowest bit of the block pointer. */
+#define COVERAGE_SPARSE_CAPACITY 63
+typedef struct coverage_sparse_s{
+    uint32_t size;
+    uint32_t pos[COVERAGE_SPARSE_CAPACITY];
+    int64_t w[COVERAGE_SPARSE_CAPACITY];
+} coverage_sparse_t;
+
+#define coverage_block_is_sparse(block) (((uintptr_t)(block)) & 1u)
+#define coverage_block_sparse(block) ((coverage_sparse_t *)(((uintptr_t)(block)) & ~(uintptr_t) 1u))
+#define coverage_sparse_block(sparse) ((void *)(((uintptr_t)(sparse)) | 1u))
+
+/* blocks of coverage_t are made of bins, the bins are bases unless coverage_set_bin is used */
+static inline uint32_t coverage_block_count(coverage_t *cov, int32_t target){
+    return ((cov->target_len[target]-1)/cov->bin_size/cov->coverage_block_size)+1;
+}
+
+static inline uint32_t coverage_block_len(coverage_t *cov, int32_t target, uint32_t block_index){
+    uint32_t bin_count = (cov->target_len[target]-1)/cov->bin_size+1;
+    uint32_t block_start = block_index<<cov->coverage_block_shift;
+    return cov->coverage_block_size > bin_count - block_start ? bin_count - block_start : cov->coverage_block_size;
+}
+
 coverage_t *coverage_init(int32_t n_targets, char **target_name, uint32_t *target_len, uint32_t coverage_block_shift){
     coverage_t *cov = calloc(1, sizeof(coverage_t));
     cov->n_targets = n_targets;
@@ -62,23 +211,68 @@ coverage_t *coverage_init(int32_t n_targets, char **target_name, uint32_t *targe
     cov->bin_size = 1;
     cov->coverage_block_shift =  coverage_block_shift;
     cov->coverage_block_size = 1u<<cov->coverage_block_shift;
-    cov->coverage_blocks = calloc(n_targets, sizeof(cov_val_t *));
+    cov->coverage_mutex_shift = 1;
+    cov->coverage_blocks = calloc(n_targets, sizeof(void **));
+    cov->coverage_blocks_hi = calloc(n_targets, sizeof(int16_t **));
     for (int i = 0; i < cov->n_targets; ++i) {
         cov->target_name[i] = strdup(target_name[i]);
         cov->target_len[i] = target_len[i];
         int32_t bin_count = (cov->target_len[i]-1)/cov->bin_size+1;
         int32_t block_count =  ((bin_count-1)/cov->coverage_block_size)+1;
-        cov->coverage_blocks[i] =  calloc(block_count, sizeof(cov_val_t*));
+        cov->coverage_blocks[i] =  calloc(block_count, sizeof(void *));
+    }
+    cov->sparse_arena = arena_init(sizeof(coverage_sparse_t), COVERAGE_ARENA_SLAB);
+    coverage_set_val_type(cov, COVERAGE_VAL_DEFAULT);
+    return cov;
+}
+
+coverage_t *coverage_set_val_type(coverage_t *cov, int val_type){
+    /* must be called before any update, the high planes are only needed by the 16 bits counters */
+    cov->val_type = val_type;
+    cov->kernel = coverage_kernel_select(val_type);
+    if (cov->arena) arena_destroy(cov->arena);
+    cov->arena = arena_init(cov->coverage_block_size * cov->kernel->val_size, COVERAGE_ARENA_SLAB);
+    for (int i = 0; i < cov->n_targets; ++i) {
+        if (val_type == COVERAGE_VAL_U16 && !cov->coverage_blocks_hi[i]) cov->coverage_blocks_hi[i] = calloc(coverage_block_count(cov, i), sizeof(int16_t *));
     }
     return cov;
 }
 
+coverage_t *coverage_set_bin(coverage_t *cov, uint32_t bin_size, int bin_mode){
+    /* must be called right after coverage_init. COVERAGE_BIN_OVERLAP sums the overlapping bases of each bin
+     * and reports the mean depth of the bin, COVERAGE_BIN_COUNT counts the segments overlapping each bin. */
+    if (bin_size < 1) bin_size = 1;
+    cov->bin_size = bin_size;
+    cov->bin_mode = bin_mode;
+    for (int i = 0; i < cov->n_targets; ++i) {
+        free(cov->coverage_blocks[i]);
+        cov->coverage_blocks[i] = calloc(coverage_block_count(cov, i), sizeof(void *));
+        if (cov->coverage_blocks_hi[i]) {
+            free(cov->coverage_blocks_hi[i]);
+            cov->coverage_blocks_hi[i] = calloc(coverage_block_count(cov, i), sizeof(int16_t *));
+        }
+    }
+    return cov;
+}
+
+coverage_t *coverage_set_mode(coverage_t *cov, int mode){
+    /* COVERAGE_MODE_DIFF only records +1/-1 at the boundaries of each segment inside a block,
+     * the depth is restored by a prefix sum over the block in extract_interval. */
+    cov->mode = mode;
+    return cov;
+}
+
+coverage_t *coverage_set_mutex_shift(coverage_t *cov, uint32_t mutex_shift){
+    /* each mutex guards 1<<mutex_shift blocks, must be called before coverage_mt */
+    cov->coverage_mutex_shift = mutex_shift;
+    return cov;
+}
+
 coverage_t *coverage_mt(coverage_t *cov){
     cov->is_mt = 1;
-    cov->coverage_mutex_shift = 1;
     cov->coverage_block_mutexes = calloc(cov->n_targets, sizeof(pthread_mutex_t *));
     for (int i = 0; i < cov->n_targets; ++i) {
-        int32_t block_count =  ((cov->target_len[i]-1)/cov->coverage_block_size)+1;
+        int32_t block_count =  coverage_block_count(cov, i);
         int32_t block_mutex_count = ((block_count-1u)>>cov->coverage_mutex_shift)+1;
         cov->coverage_block_mutexes[i] =  calloc(block_mutex_count, sizeof(pthread_mutex_t));
         for (int j = 0; j < block_mutex_count; ++j) pthread_mutex_init(&cov->coverage_block_mutexes[i][j], NULL);
@@ -86,11 +280,173 @@ coverage_t *coverage_mt(coverage_t *cov){
     return cov;
 }
 
+coverage_t *coverage_shard(coverage_t *cov, int n_shards, size_t mem_limit){
+    /* each worker takes a private shard from the pool, blocks that do not fit into mem_limit fall back to
+     * the shared structure, which is therefore always protected by the block mutexes. */
+    if (!cov->is_mt) coverage_mt(cov);
+    cov->n_shards = n_shards;
+    cov->shard_mem = 0;
+    cov->shard_mem_limit = mem_limit;
+    cov->shards = calloc(n_shards, sizeof(coverage_t *));
+    cov->shard_pool = mt_buffer_init();
+    for (int i = 0; i < n_shards; ++i) {
+        cov->shards[i] = coverage_init(cov->n_targets, cov->target_name, cov->target_len, cov->coverage_block_shift);
+        coverage_set_bin(cov->shards[i], cov->bin_size, cov->bin_mode);
+        coverage_set_mode(cov->shards[i], cov->mode);
+        coverage_set_val_type(cov->shards[i], cov->val_type);
+        /* the shards allocate from their own arenas, which the shared structure adopts in coverage_reduce */
+        cov->shards[i]->parent = cov;
+        mt_buffer_put(cov->shard_pool, cov->shards[i]);
+    }
+    return cov;
+}
+
+coverage_t *coverage_shard_get(coverage_t *cov){
+    if (!cov->n_shards) return cov;
+    return mt_buffer_get(cov->shard_pool);
+}
+
+int coverage_shard_put(coverage_t *cov, coverage_t *shard){
+    if (shard == cov) return 0;
+    return mt_buffer_put(cov->shard_pool, shard);
+}
+
+static int coverage_shard_reserve(coverage_t *cov, size_t size){
+    if (__sync_add_and_fetch(&cov->shard_mem, size) <= cov->shard_mem_limit) return 1;
+    __sync_sub_and_fetch(&cov->shard_mem, size);
+    return 0;
+}
+
+static void *coverage_sparse_densify(coverage_t *cov, void *coverage_block, int16_t **coverage_block_hi, uint32_t needed){
+    coverage_sparse_t *sparse = coverage_block_sparse(coverage_block);
+    void *dense = arena_alloc(cov->arena);
+    for (uint32_t i = 0; i < sparse->size; ++i) cov->kernel->addw(dense, coverage_block_hi, sparse->pos[i], needed, sparse->w[i], needed, COVERAGE_MODE_DIFF);
+    arena_free(cov->sparse_arena, sparse);
+    return dense;
+}
+
+static int coverage_shard_hold(coverage_t *cov, void **coverage_block, int16_t **coverage_block_hi, uint32_t needed){
+    /* charge the memory of a shard block when it is allocated, a new block costs a list in diff mode and a
+     * dense block otherwise, a full list is densified here so that one update never outgrows the charge */
+    size_t dense_size = cov->coverage_block_size * cov->kernel->val_size;
+    if (*coverage_block == NULL) return coverage_shard_reserve(cov->parent, cov->mode == COVERAGE_MODE_DIFF ? sizeof(coverage_sparse_t) : dense_size);
+    if (!coverage_block_is_sparse(*coverage_block)) return 1;
+    /* binned updates add at most three intervals to the list */
+    if (coverage_block_sparse(*coverage_block)->size + (cov->bin_size == 1 ? 2 : 6) <= COVERAGE_SPARSE_CAPACITY) return 1;
+    if (!coverage_shard_reserve(cov->parent, dense_size)) return 0;
+    *coverage_block = coverage_sparse_densify(cov, *coverage_block, coverage_block_hi, needed);
+    __sync_sub_and_fetch(&cov->parent->shard_mem, sizeof(coverage_sparse_t));
+    return 1;
+}
+
+static void coverage_block_addw(coverage_t *cov, void **coverage_block, int16_t **coverage_block_hi, uint32_t start, uint32_t end, int64_t w, uint32_t needed){
+    /* add w to [start, end) of the block, the block is replaced by its dense form when the list is full */
+    if (coverage_block_is_sparse(*coverage_block)) {
+        coverage_sparse_t *sparse = coverage_block_sparse(*coverage_block);
+        if (sparse->size + 2 <= COVERAGE_SPARSE_CAPACITY) {
+            sparse->pos[sparse->size] = start;
+            sparse->w[sparse->size++] = w;
+            if (end < needed) {
+                sparse->pos[sparse->size] = end;
+                sparse->w[sparse->size++] = -w;
+            }
+            return;
+        }
+        *coverage_block = coverage_sparse_densify(cov, *coverage_block, coverage_block_hi, needed);
+    }
+    if (w == 1) cov->kernel->add(*coverage_block, coverage_block_hi, start, end, needed, cov->mode);
+    else cov->kernel->addw(*coverage_block, coverage_block_hi, start, end, w, needed, cov->mode);
+}
+
+struct coverage_reduce_arg{
+    coverage_t *cov;
+    int32_t target;
+};
+
+static void *coverage_reduce_target(void *_arg){
+    struct coverage_reduce_arg *arg = _arg;
+    coverage_t *cov = arg->cov;
+    int32_t target = arg->target;
+    uint32_t block_count = coverage_block_count(cov, target);
+    int16_t *no_hi = NULL;
+    for (int j = 0; j < block_count; ++j){
+        uint32_t needed = coverage_block_len(cov, target, j);
+        void *coverage_block = cov->coverage_blocks[target][j];
+        int16_t **coverage_block_hi = cov->coverage_blocks_hi[target] ? &cov->coverage_blocks_hi[target][j] : &no_hi;
+        for (int k = 0; k < cov->n_shards; ++k){
+            coverage_t *shard = cov->shards[k];
+            void *shard_block = shard->coverage_blocks[target][j];
+            int16_t *shard_block_hi = shard->coverage_blocks_hi[target] ? shard->coverage_blocks_hi[target][j] : NULL;
+            if (!shard_block) continue;
+            shard->coverage_blocks[target][j] = NULL;
+            if (shard_block_hi) shard->coverage_blocks_hi[target][j] = NULL;
+            if (!coverage_block) {
+                coverage_block = shard_block;
+                *coverage_block_hi = shard_block_hi;
+                continue;
+            }
+            if (coverage_block_is_sparse(shard_block)) {
+                coverage_sparse_t *sparse = coverage_block_sparse(shard_block);
+                for (uint32_t l = 0; l < sparse->size; ++l) coverage_block_addw(cov, &coverage_block, coverage_block_hi, sparse->pos[l], needed, sparse->w[l], needed);
+                arena_free(shard->sparse_arena, sparse);
+                continue;
+            }
+            if (coverage_block_is_sparse(coverage_block)) coverage_block = coverage_sparse_densify(cov, coverage_block, coverage_block_hi, needed);
+            cov->kernel->merge(coverage_block, coverage_block_hi, shard_block, shard_block_hi, needed);
+            arena_free(shard->arena, shard_block);
+            free(shard_block_hi);
+        }
+        cov->coverage_blocks[target][j] = coverage_block;
+    }
+    return NULL;
+}
+
+int coverage_reduce(coverage_t *cov, mt_server *s){
+    /* merge the shards into the shared structure, one job per target */
+    if (!cov->n_shards) return 0;
+    struct coverage_reduce_arg *args = calloc(cov->n_targets, sizeof(struct coverage_reduce_arg));
+    mt_queue *q = s ? mt_queue_init(s, INT_MAX, 0, MT_QUEUE_MODE_IGNORED) : NULL;
+    for (int i = 0; i < cov->n_targets; ++i){
+        args[i].cov = cov;
+        args[i].target = i;
+        if (q) mt_queue_dispatch(q, coverage_reduce_target, &args[i], NULL, NULL, 0);
+        else coverage_reduce_target(&args[i]);
+    }
+    if (q) {
+        mt_queue_dispatch_end(q);
+        mt_queue_wait(q, MT_FINISH);
+        mt_queue_destroy(q);
+    }
+    free(args);
+    /* the blocks taken over from the shards still live in their slabs */
+    for (int i = 0; i < cov->n_shards; ++i) {
+        arena_adopt(cov->arena, cov->shards[i]->arena);
+        arena_adopt(cov->sparse_arena, cov->shards[i]->sparse_arena);
+        cov->shards[i]->arena = cov->shards[i]->sparse_arena = NULL;
+        coverage_destroy(cov->shards[i]);
+    }
+    free(cov->shards);
+    mt_buffer_destroy(cov->shard_pool, NULL);
+    cov->shards = NULL;
+    cov->shard_pool = NULL;
+    cov->n_shards = 0;
+    cov->shard_mem = 0;
+    return 0;
+}
+
 int coverage_destroy(coverage_t * cov){
+    if (cov->n_shards) {
+        for (int i = 0; i < cov->n_shards; ++i) coverage_destroy(cov->shards[i]);
+        free(cov->shards);
+        mt_buffer_destroy(cov->shard_pool, NULL);
+    }
     for (int i = 0; i < cov->n_targets; ++i) {
-        uint32_t block_count = ((cov->target_len[i]-1)>>cov->coverage_block_shift)+1;
-        for (int j = 0; j < block_count; ++j) if (cov->coverage_blocks[i][j]!=NULL) free(cov->coverage_blocks[i][j]);
+        uint32_t block_count = coverage_block_count(cov, i);
         free(cov->coverage_blocks[i]);
+        if (cov->coverage_blocks_hi[i]) {
+            for (int j = 0; j < block_count; ++j) free(cov->coverage_blocks_hi[i][j]);
+            free(cov->coverage_blocks_hi[i]);
+        }
         if (cov->is_mt) {
             uint32_t block_mutex_count = ((block_count-1)>>cov->coverage_mutex_shift)+1;
             for (int j = 0; j < block_mutex_count; ++j) pthread_mutex_destroy(&cov->coverage_block_mutexes[i][j]);
@@ -98,7 +454,11 @@ int coverage_destroy(coverage_t * cov){
         }
     }
     free(cov->coverage_blocks);
+    free(cov->coverage_blocks_hi);
     if (cov->is_mt) free(cov->coverage_block_mutexes);
+    /* the blocks go away with the slabs, the arenas of a reduced shard belong to its parent */
+    if (cov->arena) arena_destroy(cov->arena);
+    if (cov->sparse_arena) arena_destroy(cov->sparse_arena);
     for (int i=0; i < cov->n_targets; ++i) free(cov->target_name[i]);
     free(cov->target_name);
     free(cov->target_len);
@@ -106,85 +466,197 @@ int coverage_destroy(coverage_t * cov){
     return 0;
 }
 
+static void coverage_block_add_bin(coverage_t *cov, void **coverage_block, int16_t **coverage_block_hi, uint32_t start, uint32_t end, uint32_t needed){
+    /* start and end are the bases inside the block */
+    uint32_t bin_size = cov->bin_size;
+    uint32_t bin_start = start / bin_size, bin_end = (end - 1) / bin_size;
+    if (cov->bin_mode == COVERAGE_BIN_COUNT) {
+        coverage_block_addw(cov, coverage_block, coverage_block_hi, bin_start, bin_end + 1, 1, needed);
+    } else if (bin_start == bin_end) {
+        coverage_block_addw(cov, coverage_block, coverage_block_hi, bin_start, bin_start + 1, end - start, needed);
+    } else {
+        coverage_block_addw(cov, coverage_block, coverage_block_hi, bin_start, bin_start + 1, (bin_start + 1) * bin_size - start, needed);
+        if (bin_end > bin_start + 1) coverage_block_addw(cov, coverage_block, coverage_block_hi, bin_start + 1, bin_end, bin_size, needed);
+        coverage_block_addw(cov, coverage_block, coverage_block_hi, bin_end, bin_end + 1, end - bin_end * bin_size, needed);
+    }
+}
+
+int coverage_release(coverage_t *cov, int32_t target, uint32_t block_index_start, uint32_t block_index_end){
+    /* free the blocks that will never be used again */
+    for (uint32_t j = block_index_start; j < block_index_end; ++j) {
+        void *coverage_block = cov->coverage_blocks[target][j];
+        if (coverage_block_is_sparse(coverage_block)) arena_free(cov->sparse_arena, coverage_block_sparse(coverage_block));
+        else arena_free(cov->arena, coverage_block);
+        cov->coverage_blocks[target][j] = NULL;
+        if (cov->coverage_blocks_hi[target]) {
+            free(cov->coverage_blocks_hi[target][j]);
+            cov->coverage_blocks_hi[target][j] = NULL;
+        }
+    }
+    return 0;
+}
+
+size_t coverage_peak_mem(coverage_t *cov){
+    return arena_high_water(cov->arena);
+}
+
 /* starts are 0-based and ends are 1-based */
 int coverage_update(coverage_t *cov, int32_t target, uint32_t start, uint32_t end){
     /* this function simply trust its arguments without checking whether target is present and coordinate is in valid range */
     uint32_t block_index_start, block_index_end, block_index, block_start, block_end, new_start, new_end;
-    cov_val_t *coverage_block;
-    cov_val_t **coverage_block_target;
+    uint32_t block_span = cov->coverage_block_size * cov->bin_size;
+    void *coverage_block;
+    void **coverage_block_target;
+    int16_t *no_hi = NULL;
+    int16_t **coverage_block_hi;
     pthread_mutex_t *mutex;
-    block_index_start = start/cov->coverage_block_size;
-    block_index_end = (end-1)/cov->coverage_block_size;
+    block_index_start = start/block_span;
+    block_index_end = (end-1)/block_span;
     while (block_index_start <= block_index_end){
         block_index = block_index_start;
-        block_start = block_index<<cov->coverage_block_shift;
+        block_start = block_index*block_span;
         new_start = (start > block_start) ? start - block_start : 0;
-        new_end = (end - block_start > cov->coverage_block_size) ? cov->coverage_block_size : end - block_start;
+        new_end = (end - block_start > block_span) ? block_span : end - block_start;
         coverage_block_target = cov->coverage_blocks[target];
         if (cov->is_mt) {
             mutex=&cov->coverage_block_mutexes[target][block_index>>cov->coverage_mutex_shift];
             pthread_mutex_lock(mutex);
         }
         coverage_block = coverage_block_target[block_index];
+        int needed = coverage_block_len(cov, target, block_index);
+        coverage_block_hi = cov->coverage_blocks_hi[target] ? &cov->coverage_blocks_hi[target][block_index] : &no_hi;
+        if (cov->parent && !coverage_shard_hold(cov, &coverage_block, coverage_block_hi, needed)) {
+            /* the shards are full, hand this part over to the shared structure */
+            coverage_update(cov->parent, target, block_start + new_start, block_start + new_end);
+            block_index_start++;
+            continue;
+        }
         if (coverage_block == NULL) {
-            uint32_t target_len = cov->target_len[target];
-            int needed=cov->coverage_block_size > target_len - block_start ? target_len - block_start : cov->coverage_block_size ;
-            coverage_block = calloc(needed, sizeof(cov_val_t));
-            cov->coverage_blocks[target][block_index] = coverage_block;
+            if (cov->mode == COVERAGE_MODE_DIFF) coverage_block = coverage_sparse_block(arena_alloc(cov->sparse_arena));
+            else coverage_block = arena_alloc(cov->arena);
         }
-        while (new_start < new_end) coverage_block[new_start++]++;
+        if (cov->bin_size == 1) coverage_block_addw(cov, &coverage_block, coverage_block_hi, new_start, new_end, 1, needed);
+        else coverage_block_add_bin(cov, &coverage_block, coverage_block_hi, new_start, new_end, needed);
+        coverage_block_target[block_index] = coverage_block;
         if (cov->is_mt) pthread_mutex_unlock(mutex);
         block_index_start++;
     }
     return 0;
 }
 
-typedef struct {
-    double A;
-    double C;
-    double G;
-    double T;
-    double N;
-} cov2_val_t;
-
-typedef struct coverage2_s{
-    int32_t n_targets;
-    char **target_name;
-    uint32_t *target_len;
-    uint32_t coverage_block_shift;
-    uint32_t coverage_block_size;
-    cov2_val_t ***coverage_blocks;
-    int is_mt;
-    uint32_t coverage_mutex_shift;
-    pthread_mutex_t **coverage_block_mutexes;
-} coverage2_t;
-
 coverage2_t *coverage2_init(int32_t n_targets, char **target_name, uint32_t *target_len, uint32_t coverage_block_shift){
+    coverage_unpack_select();
     coverage2_t *cov = calloc(1, sizeof(coverage2_t));
     cov->n_targets = n_targets;
     cov->target_name = calloc(n_targets, sizeof(char *));
     cov->target_len = calloc(n_targets, sizeof(uint32_t));
     cov->coverage_block_shift =  coverage_block_shift;
     cov->coverage_block_size = 1u<<cov->coverage_block_shift;
-    cov->coverage_blocks = calloc(n_targets * 2, sizeof(cov2_val_t *));
+    cov->coverage_mutex_shift = 1;
+    cov->coverage_blocks = calloc(n_targets * 2, sizeof(void **));
+    cov->coverage_blocks_hi = calloc(n_targets * 2, sizeof(int16_t **));
+    cov->coverage_block_depth = calloc(n_targets * 2, sizeof(uint32_t *));
     for (int i = 0; i < cov->n_targets; ++i) {
         cov->target_name[i] = strdup(target_name[i]);
         cov->target_len[i] = target_len[i];
         int32_t bin_count = (cov->target_len[i]-1)+1;
         int32_t block_count =  ((bin_count-1)/cov->coverage_block_size)+1;
-        cov->coverage_blocks[i] =  calloc(block_count, sizeof(cov_val_t*));
+        cov->coverage_blocks[i] =  calloc(block_count, sizeof(void *));
+        cov->coverage_block_depth[i] = calloc(block_count, sizeof(uint32_t));
     }
     for (int i = cov->n_targets; i < cov->n_targets * 2; ++i){
         int32_t bin_count = (cov->target_len[i - cov->n_targets]-1)+1;
         int32_t block_count =  ((bin_count-1)/cov->coverage_block_size)+1;
-        cov->coverage_blocks[i] =  calloc(block_count, sizeof(cov2_val_t*));
+        cov->coverage_blocks[i] =  calloc(block_count, sizeof(void *));
+        cov->coverage_block_depth[i] = calloc(block_count, sizeof(uint32_t));
+    }
+    coverage2_set_val_type(cov, COVERAGE_VAL_DEFAULT);
+    return cov;
+}
+
+coverage2_t *coverage2_set_val_type(coverage2_t *cov, int val_type){
+    cov->val_type = val_type;
+    cov->kernel = coverage_kernel_select(val_type);
+    if (cov->arena) arena_destroy(cov->arena);
+    cov->arena = arena_init(cov->coverage_block_size * COVERAGE_CHANNEL * cov->kernel->val_size, COVERAGE_ARENA_SLAB);
+    for (int i = 0; i < cov->n_targets * 2; ++i) {
+        int32_t block_count = ((cov->target_len[i % cov->n_targets]-1)/cov->coverage_block_size)+1;
+        if (val_type == COVERAGE_VAL_U16 && !cov->coverage_blocks_hi[i]) cov->coverage_blocks_hi[i] = calloc(block_count, sizeof(int16_t *));
+    }
+    return cov;
+}
+
+int coverage2_load(coverage2_t *cov, int32_t target_index, uint32_t block_index, double *counts){
+    /* convert the block into COVERAGE_CHANNEL doubles per position, returns the number of positions */
+    int32_t target = target_index % cov->n_targets;
+    uint32_t block_start = block_index << cov->coverage_block_shift;
+    uint32_t needed = cov->coverage_block_size > cov->target_len[target] - block_start ? cov->target_len[target] - block_start : cov->coverage_block_size;
+    void *coverage_block = cov->coverage_blocks[target_index][block_index];
+    if (!coverage_block) {
+        memset(counts, 0, needed * COVERAGE_CHANNEL * sizeof(double));
+        return needed;
+    }
+    int16_t *coverage_block_hi = cov->coverage_blocks_hi[target_index] ? cov->coverage_blocks_hi[target_index][block_index] : NULL;
+    cov->kernel->load(counts, coverage_block, coverage_block_hi, needed * COVERAGE_CHANNEL, COVERAGE_MODE_BASE);
+    return needed;
+}
+
+static size_t coverage2_stride(coverage2_t *cov){
+    /* bytes between two blocks of the mapped storage */
+    return (size_t) cov->coverage_block_size * COVERAGE_CHANNEL * cov->kernel->val_size;
+}
+
+static size_t coverage2_map_size(coverage2_t *cov, int32_t target_index){
+    uint32_t block_count = ((cov->target_len[target_index % cov->n_targets]-1)>>cov->coverage_block_shift)+1;
+    return block_count * coverage2_stride(cov);
+}
+
+coverage2_t *coverage2_set_storage(coverage2_t *cov, int storage){
+    /* must be called after coverage2_set_val_type and before any update. COVERAGE_STORAGE_MMAP reserves a single
+     * range for all the target indexes up front, so the number of mappings does not grow with the targets, pages
+     * are only backed once they are written, and huge pages are asked for where the kernel supports them. the
+     * blocks are kept when the reservation fails, which the caller can tell from cov->storage. */
+    if (storage != COVERAGE_STORAGE_MMAP || cov->storage == COVERAGE_STORAGE_MMAP) return cov;
+    size_t size = 0;
+    for (int i = 0; i < cov->n_targets * 2; ++i) size += coverage2_map_size(cov, i);
+    if (!size) return cov;
+    void *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED) return cov;
+#ifdef MADV_HUGEPAGE
+    madvise(base, size, MADV_HUGEPAGE);
+#endif
+    cov->coverage_map = base;
+    cov->coverage_map_size = size;
+    cov->coverage_base = malloc(cov->n_targets * 2 * sizeof(char *));
+    for (int i = 0; i < cov->n_targets * 2; ++i) {
+        cov->coverage_base[i] = base;
+        base = (char *) base + coverage2_map_size(cov, i);
     }
+    cov->storage = COVERAGE_STORAGE_MMAP;
+    return cov;
+}
+
+coverage2_t *coverage2_set_mutex_shift(coverage2_t *cov, uint32_t mutex_shift){
+    cov->coverage_mutex_shift = mutex_shift;
+    return cov;
+}
+
+coverage2_t *coverage2_set_mask(coverage2_t *cov, int32_t target, uint32_t start, uint32_t end){
+    /* once a mask is set, only the blocks overlapping [start, end) of the masked targets are allocated and counted,
+     * for both strands */
+    if (!cov->coverage_mask) {
+        cov->coverage_mask = calloc(cov->n_targets, sizeof(uint8_t *));
+        for (int i = 0; i < cov->n_targets; ++i)
+            cov->coverage_mask[i] = calloc(((cov->target_len[i]-1)>>cov->coverage_block_shift)+1, sizeof(uint8_t));
+    }
+    if (start >= end) return cov;
+    if (end > cov->target_len[target]) end = cov->target_len[target];
+    for (uint32_t i = start>>cov->coverage_block_shift; i <= (end-1)>>cov->coverage_block_shift; ++i) cov->coverage_mask[target][i] = 1;
     return cov;
 }
 
 coverage2_t *coverage2_mt(coverage2_t *cov){
     cov->is_mt = 1;
-    cov->coverage_mutex_shift = 1;
     cov->coverage_block_mutexes = calloc(cov->n_targets * 2, sizeof(pthread_mutex_t *));
     for (int i = 0; i < cov->n_targets; ++i) {
         int32_t block_count =  ((cov->target_len[i]-1)/cov->coverage_block_size)+1;
@@ -202,9 +674,15 @@ coverage2_t *coverage2_mt(coverage2_t *cov){
 }
 
 int coverage2_destroy(coverage2_t * cov){
+    for (int i = 0; i < cov->n_targets * 2; ++i) {
+        if (!cov->coverage_blocks_hi[i]) continue;
+        uint32_t block_count = ((cov->target_len[i % cov->n_targets]-1)>>cov->coverage_block_shift)+1;
+        for (int j = 0; j < block_count; ++j) free(cov->coverage_blocks_hi[i][j]);
+        free(cov->coverage_blocks_hi[i]);
+    }
+    free(cov->coverage_blocks_hi);
     for (int i = 0; i < cov->n_targets; ++i) {
         uint32_t block_count = ((cov->target_len[i]-1)>>cov->coverage_block_shift)+1;
-        for (int j = 0; j < block_count; ++j) if (cov->coverage_blocks[i][j]!=NULL) free(cov->coverage_blocks[i][j]);
         free(cov->coverage_blocks[i]);
         if (cov->is_mt) {
             uint32_t block_mutex_count = ((block_count-1)>>cov->coverage_mutex_shift)+1;
@@ -214,7 +692,6 @@ int coverage2_destroy(coverage2_t * cov){
     }
     for (int i = cov->n_targets; i < cov->n_targets * 2; ++i){
         uint32_t block_count = ((cov->target_len[i - cov->n_targets]-1)>>cov->coverage_block_shift)+1;
-        for (int j = 0; j < block_count; ++j) if (cov->coverage_blocks[i][j]!=NULL) free(cov->coverage_blocks[i][j]);
         free(cov->coverage_blocks[i]);
         if (cov->is_mt) {
             uint32_t block_mutex_count = ((block_count-1)>>cov->coverage_mutex_shift)+1;
@@ -223,7 +700,18 @@ int coverage2_destroy(coverage2_t * cov){
         }
     }
     free(cov->coverage_blocks);
+    for (int i = 0; i < cov->n_targets * 2; ++i) free(cov->coverage_block_depth[i]);
+    free(cov->coverage_block_depth);
     if (cov->is_mt) free(cov->coverage_block_mutexes);
+    if (cov->coverage_mask) {
+        for (int i = 0; i < cov->n_targets; ++i) free(cov->coverage_mask[i]);
+        free(cov->coverage_mask);
+    }
+    if (cov->storage == COVERAGE_STORAGE_MMAP) {
+        munmap(cov->coverage_map, cov->coverage_map_size);
+        free(cov->coverage_base);
+    }
+    arena_destroy(cov->arena);
     for (int i=0; i < cov->n_targets; ++i) free(cov->target_name[i]);
     free(cov->target_name);
     free(cov->target_len);
@@ -231,13 +719,45 @@ int coverage2_destroy(coverage2_t * cov){
     return 0;
 }
 
+int coverage2_release(coverage2_t *cov, int32_t target_index, uint32_t block_index_start, uint32_t block_index_end){
+    /* free the blocks that will never be used again. for the mapped storage, the pages lying entirely inside the
+     * block are given back to the system, the pages shared with a neighbour block are kept */
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    for (uint32_t j = block_index_start; j < block_index_end; ++j) {
+        void *coverage_block = cov->coverage_blocks[target_index][j];
+        if (!coverage_block) continue;
+        if (cov->storage == COVERAGE_STORAGE_MMAP) {
+            uintptr_t start = ((uintptr_t) coverage_block + page - 1) & ~(page - 1);
+            uintptr_t end = ((uintptr_t) coverage_block + coverage2_stride(cov)) & ~(page - 1);
+            if (start < end) madvise((void *) start, end - start, MADV_DONTNEED);
+        } else arena_free(cov->arena, coverage_block);
+        cov->coverage_blocks[target_index][j] = NULL;
+        cov->coverage_block_depth[target_index][j] = 0;
+        if (cov->coverage_blocks_hi[target_index]) {
+            free(cov->coverage_blocks_hi[target_index][j]);
+            cov->coverage_blocks_hi[target_index][j] = NULL;
+        }
+    }
+    return 0;
+}
+
+size_t coverage2_peak_mem(coverage2_t *cov){
+    if (cov->storage != COVERAGE_STORAGE_MMAP) return arena_high_water(cov->arena);
+    size_t n = 0;
+    for (int i = 0; i < cov->n_targets * 2; ++i) {
+        uint32_t block_count = ((cov->target_len[i % cov->n_targets]-1)>>cov->coverage_block_shift)+1;
+        for (uint32_t j = 0; j < block_count; ++j) if (cov->coverage_blocks[i][j]) n++;
+    }
+    return n * coverage2_stride(cov);
+}
+
 /* starts are 0-based and ends are 1-based */
-static int base2index[16] = {-1, 0, 1, -1, 2, -1, -1, -1, 3, -1, -1, -1, -1, -1, -1, 4};
 int coverage2_update(coverage2_t *cov, int32_t target, uint32_t start, uint32_t end, char strand, uint8_t *read, int read_pos){
     /* this function simply trust its arguments without checking whether target is present and coordinate is in valid range */
     uint32_t block_index_start, block_index_end, block_index, block_start, block_end, new_start, new_end;
-    cov2_val_t *coverage_block;
-    cov2_val_t **coverage_block_target;
+    void *coverage_block;
+    void **coverage_block_target;
+    int16_t *no_hi = NULL;
     pthread_mutex_t *mutex;
     int32_t target_index = target + (strand == '-' ? cov->n_targets: 0);
     block_index_start = start/cov->coverage_block_size;
@@ -247,22 +767,29 @@ int coverage2_update(coverage2_t *cov, int32_t target, uint32_t start, uint32_t
         block_start = block_index<<cov->coverage_block_shift;
         new_start = (start > block_start) ? start - block_start : 0;
         new_end = (end - block_start > cov->coverage_block_size) ? cov->coverage_block_size : end - block_start;
+        if (cov->coverage_mask && !cov->coverage_mask[target][block_index]) {
+            read_pos += new_end - new_start;
+            block_index_start++;
+            continue;
+        }
         coverage_block_target = cov->coverage_blocks[target_index];
         if (cov->is_mt) {
             mutex=&cov->coverage_block_mutexes[target_index][block_index>>cov->coverage_mutex_shift];
             pthread_mutex_lock(mutex);
         }
-        coverage_block = coverage_block_target[block_index];
-        if (coverage_block == NULL) {
-            uint32_t target_len = cov->target_len[target];
-            int needed=cov->coverage_block_size > target_len - block_start ? target_len - block_start : cov->coverage_block_size ;
-            coverage_block = calloc(needed, sizeof(cov2_val_t));
-            cov->coverage_blocks[target_index][block_index] = coverage_block;
-        }
-        while (new_start < new_end) {
-            (*(((double *)(&coverage_block[new_start++]))+base2index[bam_seqi(read, read_pos)]))++;
-            read_pos++;
+        uint32_t target_len = cov->target_len[target];
+        int needed=cov->coverage_block_size > target_len - block_start ? target_len - block_start : cov->coverage_block_size ;
+        if (cov->storage == COVERAGE_STORAGE_MMAP) {
+            /* the pointer is only kept to tell the touched blocks to the readers */
+            coverage_block = cov->coverage_base[target_index] + block_index * coverage2_stride(cov);
+            coverage_block_target[block_index] = coverage_block;
+        } else if ((coverage_block = coverage_block_target[block_index]) == NULL) {
+            coverage_block = arena_alloc(cov->arena);
+            coverage_block_target[block_index] = coverage_block;
         }
+        cov->kernel->add2(coverage_block, cov->coverage_blocks_hi[target_index] ? &cov->coverage_blocks_hi[target_index][block_index] : &no_hi, new_start, new_end, needed, read, read_pos);
+        cov->coverage_block_depth[target_index][block_index]++;
+        read_pos += new_end - new_start;
         if (cov->is_mt) pthread_mutex_unlock(mutex);
         block_index_start++;
     }
@@ -324,17 +851,28 @@ i->value[index] = value; \
 }
 
 struct extract_interval_arg{
-    cov_val_t **coverage_blocks;
+    void **coverage_blocks;
+    int16_t **coverage_blocks_hi;
+    const coverage_kernel_t *kernel;
     uint32_t block_index_start;
     uint32_t block_index_end;
     uint32_t bin_size;
+    int bin_mode;
     uint32_t block_size;
+    int mode;
+    double *buffer;
+    uint32_t buffer_size;
+    double last_value;
+    coverage_t *release;
+    int32_t target;
     interval_t *itv;
 };
 struct extract_interval_arg *extract_interval_arg_init(){
     struct extract_interval_arg *arg;
     arg = malloc(sizeof(struct extract_interval_arg));
     if (!arg) return NULL;
+    arg->buffer = NULL;
+    arg->buffer_size = 0;
     arg->itv = interval_init();
     if (!arg->itv) {
         free(arg);
@@ -345,74 +883,145 @@ struct extract_interval_arg *extract_interval_arg_init(){
 void extract_interval_arg_destroy(void *_arg){
     struct extract_interval_arg *arg = _arg;
     interval_destroy(arg->itv);
+    free(arg->buffer);
     free(arg);
 }
-void *extract_interval(void *_args){
-    struct extract_interval_arg *args = _args;
+static void extract_interval_emit(struct extract_interval_arg *args, uint32_t bin_start, uint32_t bin_end, double value){
+    /* the bins [bin_start, bin_end) of the target have the same counter, which becomes an interval of bases. the
+     * interval is merged into the last one if they have the same value */
     interval_t *itv = args->itv;
-    cov_val_t ** coverage_blocks = args->coverage_blocks;
-    uint32_t block_index_start = args->block_index_start;
-    uint32_t block_index_end = args->block_index_end;
     uint32_t bin_size = args->bin_size;
+    uint32_t start = bin_start * bin_size, end = bin_end * bin_size;
+    if (end > itv->target_len) end = itv->target_len;
+    if (bin_size > 1 && args->bin_mode == COVERAGE_BIN_OVERLAP && value != 0) {
+        /* the mean depth of the bin, the last bin of the target may be shorter */
+        uint32_t last_start = (bin_end - 1) * bin_size;
+        if (end - last_start < bin_size && bin_end - bin_start > 1) {
+            extract_interval_emit(args, bin_start, bin_end - 1, value);
+            start = last_start;
+        }
+        value /= end - start < bin_size ? end - start : bin_size;
+    }
+    if (itv->size > 0 && args->last_value == value) itv->end[itv->size - 1] = end;
+    else {
+        interval_add(itv, start, end, value);
+        args->last_value = value;
+    }
+}
+
+static void extract_interval_sparse(struct extract_interval_arg *args, coverage_sparse_t *sparse, uint32_t bin_offset, uint32_t block_bin_count){
+    /* the runs are read from the sorted boundaries without touching the bins between them */
+    uint32_t pos[COVERAGE_SPARSE_CAPACITY];
+    int64_t w[COVERAGE_SPARSE_CAPACITY];
+    uint32_t n = sparse->size;
+    for (uint32_t i = 0; i < n; ++i) {
+        uint32_t j = i;
+        while (j > 0 && pos[j - 1] > sparse->pos[i]) {
+            pos[j] = pos[j - 1];
+            w[j] = w[j - 1];
+            j--;
+        }
+        pos[j] = sparse->pos[i];
+        w[j] = sparse->w[i];
+    }
+    int64_t sum = 0;
+    uint32_t last = 0;
+    for (uint32_t i = 0; i < n; ++i) {
+        if (pos[i] > last) {
+            extract_interval_emit(args, bin_offset + last, bin_offset + pos[i], (double) sum);
+            last = pos[i];
+        }
+        sum += w[i];
+    }
+    extract_interval_emit(args, bin_offset + last, bin_offset + block_bin_count, (double) sum);
+}
+
+void *extract_interval(void *_args){
+    struct extract_interval_arg *args = _args;
     uint32_t block_size = args->block_size;
+    uint32_t bin_count = (args->itv->target_len-1)/args->bin_size+1;
 
-    uint32_t target_len = itv->target_len;
-    int32_t bin_count = (target_len-1)/bin_size+1;
-    int32_t block_count =  ((bin_count-1)/block_size)+1;
+    if (args->buffer_size < block_size) {
+        free(args->buffer);
+        args->buffer = malloc(block_size * sizeof(double));
+        args->buffer_size = block_size;
+    }
 
-    uint32_t block_bin_count;
-    uint32_t block_index;
+    for (uint32_t block_index = args->block_index_start; block_index < args->block_index_end; ++block_index){
+        uint32_t bin_offset = block_index * block_size;
+        uint32_t block_bin_count = bin_count - bin_offset < block_size ? bin_count - bin_offset : block_size;
+        void *coverage_block = args->coverage_blocks[block_index];
+        if (!coverage_block) {
+            extract_interval_emit(args, bin_offset, bin_offset + block_bin_count, 0);
+        } else if (coverage_block_is_sparse(coverage_block)) {
+            extract_interval_sparse(args, coverage_block_sparse(coverage_block), bin_offset, block_bin_count);
+        } else {
+            int16_t *coverage_block_hi = args->coverage_blocks_hi ? args->coverage_blocks_hi[block_index] : NULL;
+            double *coverage = args->buffer;
+            args->kernel->load(coverage, coverage_block, coverage_block_hi, block_bin_count, args->mode);
+            uint32_t run_start = 0;
+            for (uint32_t i = 1; i < block_bin_count; ++i) {
+                if (coverage[i] == coverage[run_start]) continue;
+                extract_interval_emit(args, bin_offset + run_start, bin_offset + i, coverage[run_start]);
+                run_start = i;
+            }
+            extract_interval_emit(args, bin_offset + run_start, bin_offset + block_bin_count, coverage[run_start]);
+        }
+    }
+    if (args->release) coverage_release(args->release, args->target, args->block_index_start, args->block_index_end);
+    return _args;
+}
 
-    block_index = block_index_start;
-    cov_val_t *coverage = coverage_blocks[block_index];
-    if (block_index == block_count -1) block_bin_count = bin_count - (block_index) * block_size;
-    else block_bin_count = block_size;
-
-
-    int bin_index = 0;
-
-    int start =  bin_size * (block_index * block_size);
-    int end = 0;
-
-    uint32_t range_end = block_index_end * block_size * bin_size;
-    if (range_end > target_len) range_end = target_len;
-
-    while (start < range_end){
-        cov_val_t value = coverage?coverage[bin_index]:0;
-        while (1){
-            if (!coverage){
-                if (value == 0){
-                    block_index++;
-                    bin_index=0;
-                    if (block_index < block_index_end) {
-                        coverage = coverage_blocks[block_index];
-                        if (block_index == block_count -1) block_bin_count = bin_count - (block_index) * block_size;
-                        else block_bin_count = block_size;
-                    } else break;
-                } else break;
-            } else {
-                if (value == coverage[bin_index]){
-                    bin_index++;
-                    if (bin_index == block_bin_count){
-                        if (block_index == block_count -1) break;
-                        block_index++;
-                        bin_index = 0;
-                        if (block_index < block_index_end) {
-                            coverage = coverage_blocks[block_index];
-                            if (block_index == block_count -1) block_bin_count = bin_count - (block_index) * block_size;
-                            else block_bin_count = block_size;
-                        } else break;
-                    }
-                } else break;
+struct output_bw_state{
+    char *target;
+    int init;
+    int no_last;
+    uint32_t itv_last_start;
+    uint32_t itv_last_end;
+    float itv_last_value;
+};
+
+static void output_bw_write(bigWigFile_t *fp, struct output_bw_state *st, struct extract_interval_arg *arg){
+    interval_t *itv = arg->itv;
+    uint32_t block_count = (((itv->target_len-1)/arg->bin_size)/arg->block_size)+1;
+    /* check if new target is meet */
+    if (st->target != itv->target){
+        st->init = 1;
+        st->no_last = 1;
+        st->target = itv->target;
+    }
+    if (itv->size > 0) {
+        /* handle last issues */
+        if (!st->no_last) {
+            if (st->itv_last_value == itv->value[0] && st->itv_last_end == itv->start[0])
+                itv->start[0] = st->itv_last_start;
+            else {
+                if (st->init) {
+                    st->init = 0;
+                    bwAddIntervals(fp, &itv->target, &st->itv_last_start, &st->itv_last_end, &st->itv_last_value, 1);
+                } else bwAppendIntervals(fp, &st->itv_last_start, &st->itv_last_end, &st->itv_last_value, 1);
             }
+            st->no_last = 1;
         }
 
-        end = (block_index * block_size + bin_index) * bin_size;
-        interval_add(itv, start, end, value);
-        start = end;
+        if (arg->block_index_end < block_count) {
+            st->itv_last_start = itv->start[itv->size - 1];
+            st->itv_last_end = itv->end[itv->size - 1];
+            st->itv_last_value = itv->value[itv->size - 1];
+            st->no_last = 0;
+            itv->size--;
+        }
     }
-    if (itv->end[itv->size-1] > itv->target_len) itv->end[itv->size-1] = itv->target_len;
-    return _args;
+
+    if (itv->size > 0) {
+        if (st->init) {
+            st->init = 0;
+            bwAddIntervals(fp, &itv->target, &itv->start[0], &itv->end[0], &itv->value[0], 1);
+            bwAppendIntervals(fp, itv->start + 1, itv->end + 1, itv->value + 1, itv->size - 1);
+        } else bwAppendIntervals(fp, itv->start, itv->end, itv->value, itv->size);
+    }
+
+    itv->size = 0;
 }
 
 struct output_bw_mt_writer_arg{
@@ -426,177 +1035,147 @@ void * output_bw_mt_writer(void *_arg){
     bigWigFile_t *fp = ((struct output_bw_mt_writer_arg *) _arg)->fp;
 
     struct extract_interval_arg *arg;
-    interval_t *itv;
-    uint32_t itv_last_start;
-    uint32_t itv_last_end;
-    float itv_last_value;
-    int block_count = 0;
-    int no_last = 1;
-    int init = 1;
-    char *last_target = "\0";
+    struct output_bw_state st = {NULL, 1, 1, 0, 0, 0};
     while (mt_queue_receive(q, (void *)&arg, 0) == 0){
-        time_t t;
-        itv = arg->itv;
-        /* check if new target is meet */
-        if (strcmp(last_target, itv->target)!=0){
-            init = 1;
-            no_last = 1;
-            block_count =  (((itv->target_len-1)/arg->bin_size-1)/arg->block_size)+1;
-            last_target = itv->target;
-        }
-        if (itv->size > 0) {
-            /* handle last issues */
-            if (!no_last) {
-                if (itv_last_value == itv->value[0] && itv_last_end == itv->start[0])
-                    itv->start[0] = itv_last_start;
-                else {
-                    if (init) {
-                        init = 0;
-                        bwAddIntervals(fp, &itv->target, &itv_last_start, &itv_last_end, &itv_last_value, 1);
-                    } else bwAppendIntervals(fp, &itv_last_start, &itv_last_end, &itv_last_value, 1);
-                }
-            }
-
-            if (arg->block_index_end < block_count) {
-                itv_last_start = itv->start[itv->size - 1];
-                itv_last_end = itv->end[itv->size - 1];
-                itv_last_value = itv->value[itv->size - 1];
-                no_last = 0;
-                itv->size--;
-            }
-        }
-
-        if (itv->size > 0) {
-            if (init) {
-                init = 0;
-                bwAddIntervals(fp, &itv->target, &itv->start[0], &itv->end[0], &itv->value[0], 1);
-                bwAppendIntervals(fp, itv->start + 1, itv->end + 1, itv->value + 1, itv->size - 1);
-            } else bwAppendIntervals(fp, itv->start, itv->end, itv->value, itv->size);
-        }
-
-        itv->size = 0;
+        output_bw_write(fp, &st, arg);
         mt_buffer_put(b, arg);
     }
     return NULL;
 }
 
-int output_bw(coverage_t *cov, char *fn, mt_server *s){
+typedef struct coverage_bw_s{
+    coverage_t *cov;
+    bigWigFile_t *fp;
+    mt_server *s;
+    int release;
+    /* the next block to be written */
+    int32_t target;
+    uint32_t block_index;
+    struct extract_interval_arg *arg;
+    struct output_bw_state st;
+    mt_queue *q;
+    mt_buffer *b;
+    struct output_bw_mt_writer_arg mt_writer_arg;
+    pthread_t mt_writer;
+} coverage_bw_t;
+
+coverage_bw_t *output_bw_open(coverage_t *cov, char *fn, mt_server *s, int release){
+    /* with release, the blocks are freed once they are written, see output_bw_flush */
     /* some necessary preparation */
     bigWigFile_t *fp = NULL;
-    if(bwInit(1u<<17u) != 0) return 1;
+    if(bwInit(1u<<17u) != 0) return NULL;
     fp = bwOpen(fn, NULL, "w");
-    if(!fp) return 1;
-    if(bwCreateHdr(fp, 10)) return 1;
+    if(!fp) return NULL;
+    if(bwCreateHdr(fp, 10)) return NULL;
     fp->cl = bwCreateChromList(cov->target_name, cov->target_len, cov->n_targets);
-    if(!fp->cl) return 1;
-    if(bwWriteHdr(fp)) return 1;
+    if(!fp->cl) return NULL;
+    if(bwWriteHdr(fp)) return NULL;
     if (s) bwMtInit(fp, s);
 
+    coverage_bw_t *w = calloc(1, sizeof(coverage_bw_t));
+    w->cov = cov;
+    w->fp = fp;
+    w->s = s;
+    w->release = release;
+    w->target = 0;
+    w->block_index = 0;
+    w->st.init = 1;
+    w->st.no_last = 1;
     /* malloc buffer*/
-    uint32_t itv_last_start;
-    uint32_t itv_last_end;
-    float itv_last_value;
-    mt_queue *q;
-    mt_buffer *b;
-    interval_t *itv;
-    struct output_bw_mt_writer_arg mt_writer_arg;
-    pthread_t mt_writer;
-    struct extract_interval_arg *arg;
-    if (!s) arg = extract_interval_arg_init();
+    if (!s) w->arg = extract_interval_arg_init();
     else {
         int n_thread = mt_server_n_thread(s);
-        q = mt_queue_init(s, INT_MAX, INT_MAX, MT_QUEUE_MODE_SERIAL);
-        b = mt_buffer_init();
-        for (int i = 0; i < n_thread * 2; ++i) mt_buffer_put(b, extract_interval_arg_init());
-        mt_writer_arg.q = q;
-        mt_writer_arg.b = b;
-        mt_writer_arg.fp = fp;
-        pthread_create(&mt_writer, NULL, output_bw_mt_writer, &mt_writer_arg);
-    }
-    /* start writing */
-    for (int i = 0; i < cov->n_targets; ++i){
-        int init = 1;
-        int no_last = 1;
-        int block_count = ((cov->target_len[i]-1)/cov->coverage_block_size)+1;
-        int block_index_start = 0, block_index_end = 0;
+        w->q = mt_queue_init(s, INT_MAX, INT_MAX, MT_QUEUE_MODE_SERIAL);
+        w->b = mt_buffer_init();
+        for (int i = 0; i < n_thread * 2; ++i) mt_buffer_put(w->b, extract_interval_arg_init());
+        w->mt_writer_arg.q = w->q;
+        w->mt_writer_arg.b = w->b;
+        w->mt_writer_arg.fp = fp;
+        pthread_create(&w->mt_writer, NULL, output_bw_mt_writer, &w->mt_writer_arg);
+    }
+    return w;
+}
+
+static void output_bw_range(coverage_bw_t *w, struct extract_interval_arg *arg, int32_t i, uint32_t block_index_start, uint32_t block_index_end){
+    coverage_t *cov = w->cov;
+    arg->block_index_start = block_index_start;
+    arg->block_index_end = block_index_end;
+    arg->bin_size = cov->bin_size;
+    arg->bin_mode = cov->bin_mode;
+    arg->block_size = cov->coverage_block_size;
+    arg->mode = cov->mode;
+    arg->kernel = cov->kernel;
+    arg->coverage_blocks = cov->coverage_blocks[i];
+    arg->coverage_blocks_hi = cov->coverage_blocks_hi[i];
+    arg->release = w->release ? cov : NULL;
+    arg->target = i;
+    arg->itv->target = cov->target_name[i];
+    arg->itv->target_len = cov->target_len[i];
+}
+
+int output_bw_flush(coverage_bw_t *w, int32_t target, uint32_t pos){
+    /* write all the blocks lying before the block of pos on target, the caller guarantees that they will
+     * not be updated any more */
+    coverage_t *cov = w->cov;
+    struct extract_interval_arg *arg;
+    if (target > cov->n_targets) target = cov->n_targets;
+    for (; w->target <= target && w->target < cov->n_targets; w->target++, w->block_index = 0){
+        int i = w->target;
+        int block_count = coverage_block_count(cov, i);
+        int block_limit = block_count;
+        if (i == target) {
+            block_limit = pos/(cov->coverage_block_size*cov->bin_size);
+            if (block_limit > block_count) block_limit = block_count;
+        }
+        int block_index_start = w->block_index, block_index_end = w->block_index;
         int n_needed_block = (1u<<17u)/cov->coverage_block_size+1;
         int n_block = 0;
-        while (block_index_end < block_count){
+        while (block_index_end < block_limit){
             block_index_start = block_index_end;
 
             n_block=0;
-            while (block_index_end < block_count) {
+            while (block_index_end < block_limit) {
                 if (!cov->coverage_blocks[i][block_index_end++]) continue;
                 if (n_block == n_needed_block) break;
                 n_block++;
             }
 
-            if (!s) {
-                arg->block_index_start = block_index_start;
-                arg->block_index_end = block_index_end;
-                arg->bin_size = cov->bin_size;
-                arg->block_size = cov->coverage_block_size;
-                arg->coverage_blocks = cov->coverage_blocks[i];
-                arg->itv->target = cov->target_name[i];
-                arg->itv->target_len = cov->target_len[i];
-                arg = extract_interval(arg);
-                itv = arg->itv;
-
-                if (itv->size > 0) {
-                    /* handle last issues */
-                    if (!no_last) {
-                        if (itv_last_value == itv->value[0] && itv_last_end == itv->start[0])
-                            itv->start[0] = itv_last_start;
-                        else {
-                            if (init) {
-                                init = 0;
-                                bwAddIntervals(fp, &itv->target, &itv_last_start, &itv_last_end, &itv_last_value, 1);
-                            } else bwAppendIntervals(fp, &itv_last_start, &itv_last_end, &itv_last_value, 1);
-                        }
-                    }
-
-                    if (block_index_end < block_count) {
-                        itv_last_start = itv->start[itv->size - 1];
-                        itv_last_end = itv->end[itv->size - 1];
-                        itv_last_value = itv->value[itv->size - 1];
-                        no_last = 0;
-                        itv->size--;
-                    }
-                }
-
-                if (itv->size > 0) {
-                    if (init) {
-                        init = 0;
-                        bwAddIntervals(fp, &itv->target, &itv->start[0], &itv->end[0], &itv->value[0], 1);
-                        bwAppendIntervals(fp, itv->start + 1, itv->end + 1, itv->value + 1, itv->size - 1);
-                    } else bwAppendIntervals(fp, itv->start, itv->end, itv->value, itv->size);
-                }
-
-                itv->size = 0;
+            if (!w->s) {
+                arg = w->arg;
+                output_bw_range(w, arg, i, block_index_start, block_index_end);
+                extract_interval(arg);
+                output_bw_write(w->fp, &w->st, arg);
             } else {
-                arg = mt_buffer_get(b);
-                arg->block_index_start = block_index_start;
-                arg->block_index_end = block_index_end;
-                arg->bin_size = cov->bin_size;
-                arg->block_size = cov->coverage_block_size;
-                arg->coverage_blocks = cov->coverage_blocks[i];
-                arg->itv->target = cov->target_name[i];
-                arg->itv->target_len = cov->target_len[i];
-                mt_queue_dispatch(q, extract_interval, arg, NULL, NULL, 0);
+                arg = mt_buffer_get(w->b);
+                output_bw_range(w, arg, i, block_index_start, block_index_end);
+                mt_queue_dispatch(w->q, extract_interval, arg, NULL, NULL, 0);
             }
-
         }
+        w->block_index = block_index_end;
+        if (i == target && block_limit < block_count) break;
     }
-    if (!s) {
-        extract_interval_arg_destroy(arg);
+    return 0;
+}
+
+int output_bw_close(coverage_bw_t *w){
+    output_bw_flush(w, w->cov->n_targets, 0);
+    if (!w->s) {
+        extract_interval_arg_destroy(w->arg);
     } else {
-        mt_queue_dispatch_end(q);
-        mt_queue_wait(q, MT_FINISH);
-        pthread_join(mt_writer, NULL);
-        mt_queue_destroy(q);
-        mt_buffer_destroy(b, &extract_interval_arg_destroy);
+        mt_queue_dispatch_end(w->q);
+        mt_queue_wait(w->q, MT_FINISH);
+        pthread_join(w->mt_writer, NULL);
+        mt_queue_destroy(w->q);
+        mt_buffer_destroy(w->b, &extract_interval_arg_destroy);
     }
-    bwClose(fp);
+    bwClose(w->fp);
     bwCleanup();
+    free(w);
     return 0;
-}
\ No newline at end of file
+}
+
+int output_bw(coverage_t *cov, char *fn, mt_server *s){
+    coverage_bw_t *w = output_bw_open(cov, fn, s, 0);
+    if (!w) return 1;
+    return output_bw_close(w);
+}
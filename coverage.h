@@ -23,14 +23,83 @@
    SOFTWARE.
  */
 
+#define COVERAGE_MODE_BASE 0
+#define COVERAGE_MODE_DIFF 1
+
+#define COVERAGE_BIN_OVERLAP 0
+#define COVERAGE_BIN_COUNT 1
+
+#define COVERAGE_VAL_DOUBLE 0
+#define COVERAGE_VAL_FLOAT 1
+#define COVERAGE_VAL_U32 2
+#define COVERAGE_VAL_U16 3
+
+#define COVERAGE_CHANNEL 5
+
+#define COVERAGE_STORAGE_BLOCKS 0
+#define COVERAGE_STORAGE_MMAP 1
+
+#ifndef COVERAGE_VAL_DEFAULT
+#define COVERAGE_VAL_DEFAULT COVERAGE_VAL_DOUBLE
+#endif
+
+int coverage_val_type(const char *name);
+uint32_t coverage_auto_block_shift(int32_t n_targets, uint32_t *target_len, uint32_t bin_size, uint32_t read_span);
+uint32_t coverage_auto_mutex_shift(int32_t n_targets, uint32_t *target_len, uint32_t bin_size, uint32_t block_shift);
+
 typedef struct coverage_s coverage_t;
 coverage_t *coverage_init(int32_t n_targets, char **target_name, uint32_t *target_len, uint32_t coverage_block_shift);
+coverage_t *coverage_set_mode(coverage_t *cov, int mode);
+coverage_t *coverage_set_val_type(coverage_t *cov, int val_type);
+coverage_t *coverage_set_bin(coverage_t *cov, uint32_t bin_size, int bin_mode);
+coverage_t *coverage_set_mutex_shift(coverage_t *cov, uint32_t mutex_shift);
 coverage_t *coverage_mt(coverage_t *cov);
+coverage_t *coverage_shard(coverage_t *cov, int n_shards, size_t mem_limit);
+coverage_t *coverage_shard_get(coverage_t *cov);
+int coverage_shard_put(coverage_t *cov, coverage_t *shard);
+int coverage_reduce(coverage_t *cov, mt_server *s);
 int coverage_destroy(coverage_t * cov);
 int coverage_update(coverage_t *cov, int32_t target, uint32_t start, uint32_t end);
-typedef struct coverage2_s coverage2_t;
+int coverage_release(coverage_t *cov, int32_t target, uint32_t block_index_start, uint32_t block_index_end);
+size_t coverage_peak_mem(coverage_t *cov);
+
+/* the blocks of coverage2_t hold COVERAGE_CHANNEL (A, C, G, T, N) counters per position, the first n_targets
+ * target indexes are for the forward strand and the others are for the reverse strand. coverage_block_depth counts
+ * the segments added to each block, a segment covers a position at most once, so it bounds the depth of the block. */
+typedef struct coverage2_s{
+    int32_t n_targets;
+    char **target_name;
+    uint32_t *target_len;
+    uint32_t coverage_block_shift;
+    uint32_t coverage_block_size;
+    void ***coverage_blocks;
+    int16_t ***coverage_blocks_hi;
+    uint32_t **coverage_block_depth;
+    int val_type;
+    const struct coverage_kernel_s *kernel;
+    struct arena_s *arena;
+    int storage;
+    void *coverage_map;
+    size_t coverage_map_size;
+    char **coverage_base;
+    uint8_t **coverage_mask;
+    int is_mt;
+    uint32_t coverage_mutex_shift;
+    pthread_mutex_t **coverage_block_mutexes;
+} coverage2_t;
 coverage2_t *coverage2_init(int32_t n_targets, char **target_name, uint32_t *target_len, uint32_t coverage_block_shift);
+coverage2_t *coverage2_set_val_type(coverage2_t *cov, int val_type);
+int coverage2_load(coverage2_t *cov, int32_t target_index, uint32_t block_index, double *counts);
+coverage2_t *coverage2_set_storage(coverage2_t *cov, int storage);
+coverage2_t *coverage2_set_mutex_shift(coverage2_t *cov, uint32_t mutex_shift);
+coverage2_t *coverage2_set_mask(coverage2_t *cov, int32_t target, uint32_t start, uint32_t end);
 coverage2_t *coverage2_mt(coverage2_t *cov);
 int coverage2_destroy(coverage2_t * cov);
 int coverage2_update(coverage2_t *cov, int32_t target, uint32_t start, uint32_t end, char strand, uint8_t *seq, int rpos);
+int coverage2_release(coverage2_t *cov, int32_t target_index, uint32_t block_index_start, uint32_t block_index_end);
+size_t coverage2_peak_mem(coverage2_t *cov);
+typedef struct coverage_bw_s coverage_bw_t;
+coverage_bw_t *output_bw_open(coverage_t *cov, char *fn, mt_server *s, int release);
+int output_bw_flush(coverage_bw_t *w, int32_t target, uint32_t pos);
+int output_bw_close(coverage_bw_t *w);
 int output_bw(coverage_t *cov, char *fn, mt_server *s);
\ No newline at end of file
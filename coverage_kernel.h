@@ -0,0 +1,148 @@
+/* The MIT License (MIT)
+
+   Copyright (c) 2023 Anrui Liu <liuar6@gmail.com>
+
+   Permission is hereby granted, free of charge, to any person obtaining
+   a copy of this software and associated documentation files (the
+   “Software”), to deal in the Software without restriction, including
+   without limitation the rights to use, copy, modify, merge, publish,
+   distribute, sublicense, and/or sell copies of the Software, and to
+   permit persons to whom the Software is furnished to do so, subject to
+   the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND,
+   EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+   NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+   BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+   ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE.
+ */
+/* "coverage_kernel.h" generates the update and extract kernels of the coverage
+  blocks for a given counter type, in a similar way like "khash.h" and "vector.h".
+  The user must include "coverage.h" and provide coverage_unpack(), which turns
+  n bases of a bam sequence into channel indexes, before instantiating the kernels. */
+
+#ifndef SAMVT_COVERAGE_KERNEL_H
+#define SAMVT_COVERAGE_KERNEL_H
+
+#include <stdint.h>
+
+typedef struct coverage_kernel_s{
+    size_t val_size;
+    void (*add)(void *block, int16_t **hi, uint32_t start, uint32_t end, uint32_t n, int mode);
+    void (*addw)(void *block, int16_t **hi, uint32_t start, uint32_t end, int64_t w, uint32_t n, int mode);
+    void (*load)(double *buffer, void *block, int16_t *hi, uint32_t n, int mode);
+    void (*merge)(void *dst, int16_t **dst_hi, void *src, int16_t *src_hi, uint32_t n);
+    void (*add2)(void *block, int16_t **hi, uint32_t start, uint32_t end, uint32_t n, uint8_t *read, int read_pos);
+} coverage_kernel_t;
+
+/* bases decoded at a time by cov_add2 */
+#define COVERAGE_UNPACK_CHUNK 256
+
+/* plain counters, hi is never touched */
+#define cov_plain_inc(block, hi, i, n) ((block)[(i)]++)
+#define cov_plain_dec(block, hi, i, n) ((block)[(i)]--)
+#define cov_plain_get(block, hi, i) ((block)[(i)])
+#define cov_plain_set(block, hi, i, v, n) ((block)[(i)] = (v))
+
+/* 16 bits counters with an overflow escape: once a counter leaves the range of int16_t, the carry goes to
+ * a lazily allocated high plane of the block, so that value = hi * 65536 + lo. Signed counters are used so
+ * that the -1 of the difference array does not escape. */
+static inline int16_t *cov_escape_plane(int16_t **hi, uint32_t n){
+    if (!*hi) *hi = calloc(n, sizeof(int16_t));
+    return *hi;
+}
+static inline void cov_escape_inc(int16_t *block, int16_t **hi, uint32_t i, uint32_t n){
+    if (block[i] == INT16_MAX) {
+        block[i] = INT16_MIN;
+        cov_escape_plane(hi, n)[i]++;
+    } else block[i]++;
+}
+static inline void cov_escape_dec(int16_t *block, int16_t **hi, uint32_t i, uint32_t n){
+    if (block[i] == INT16_MIN) {
+        block[i] = INT16_MAX;
+        cov_escape_plane(hi, n)[i]--;
+    } else block[i]--;
+}
+static inline int64_t cov_escape_get(int16_t *block, int16_t *hi, uint32_t i){
+    return hi ? (int64_t)hi[i] * 65536 + block[i] : block[i];
+}
+static inline void cov_escape_set(int16_t *block, int16_t **hi, uint32_t i, int64_t value, uint32_t n){
+    int16_t lo = (int16_t)(((value + 32768) & 0xffff) - 32768);
+    int64_t high = (value - lo) / 65536;
+    block[i] = lo;
+    if (high != 0 || *hi) cov_escape_plane(hi, n)[i] = (int16_t) high;
+}
+
+/* sum_t is the type used for the prefix sum of the difference array, the unsigned counters rely on the
+ * modular arithmetic of val_t, so that the -1 of the difference array cancels out. */
+#define COVERAGE_KERNEL_INIT(name, val_t, sum_t, inc, dec, get, set) \
+\
+static void cov_add_##name(void *_block, int16_t **hi, uint32_t start, uint32_t end, uint32_t n, int mode){ \
+    val_t *block = _block; \
+    if (mode == COVERAGE_MODE_DIFF) { \
+        inc(block, hi, start, n); \
+        if (end < n) dec(block, hi, end, n); \
+    } else while (start < end) { \
+        inc(block, hi, start, n); \
+        start++; \
+    } \
+} \
+\
+static void cov_addw_##name(void *_block, int16_t **hi, uint32_t start, uint32_t end, int64_t w, uint32_t n, int mode){ \
+    val_t *block = _block; \
+    if (mode == COVERAGE_MODE_DIFF) { \
+        set(block, hi, start, (sum_t)(get(block, *hi, start) + w), n); \
+        if (end < n) set(block, hi, end, (sum_t)(get(block, *hi, end) - w), n); \
+    } else while (start < end) { \
+        set(block, hi, start, (sum_t)(get(block, *hi, start) + w), n); \
+        start++; \
+    } \
+} \
+\
+static void cov_load_##name(double *buffer, void *_block, int16_t *hi, uint32_t n, int mode){ \
+    val_t *block = _block; \
+    if (mode == COVERAGE_MODE_DIFF) { \
+        sum_t sum = 0; \
+        for (uint32_t i = 0; i < n; ++i) { \
+            sum += get(block, hi, i); \
+            buffer[i] = sum; \
+        } \
+    } else for (uint32_t i = 0; i < n; ++i) buffer[i] = get(block, hi, i); \
+} \
+\
+static void cov_merge_##name(void *_dst, int16_t **dst_hi, void *_src, int16_t *src_hi, uint32_t n){ \
+    val_t *dst = _dst; \
+    val_t *src = _src; \
+    for (uint32_t i = 0; i < n; ++i) set(dst, dst_hi, i, (sum_t)(get(dst, *dst_hi, i) + get(src, src_hi, i)), n); \
+} \
+\
+static void cov_add2_##name(void *_block, int16_t **hi, uint32_t start, uint32_t end, uint32_t n, uint8_t *read, int read_pos){ \
+    val_t *block = _block; \
+    uint8_t index[COVERAGE_UNPACK_CHUNK]; \
+    while (start < end) { \
+        uint32_t len = end - start < COVERAGE_UNPACK_CHUNK ? end - start : COVERAGE_UNPACK_CHUNK; \
+        coverage_unpack(index, read, read_pos, len); \
+        for (uint32_t i = 0; i < len; ++i) inc(block, hi, (start + i) * COVERAGE_CHANNEL + index[i], n * COVERAGE_CHANNEL); \
+        start += len; \
+        read_pos += len; \
+    } \
+} \
+\
+static const coverage_kernel_t coverage_kernel_##name = { \
+    sizeof(val_t), cov_add_##name, cov_addw_##name, cov_load_##name, cov_merge_##name, cov_add2_##name \
+};
+
+#define COVERAGE_KERNEL_INIT_PLAIN(name, val_t) \
+    COVERAGE_KERNEL_INIT(name, val_t, val_t, cov_plain_inc, cov_plain_dec, cov_plain_get, cov_plain_set)
+#define COVERAGE_KERNEL_INIT_ESCAPE(name) \
+    COVERAGE_KERNEL_INIT(name, int16_t, int64_t, cov_escape_inc, cov_escape_dec, cov_escape_get, cov_escape_set)
+
+#define coverage_kernel(name) (&coverage_kernel_##name)
+
+#endif //SAMVT_COVERAGE_KERNEL_H
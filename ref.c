@@ -0,0 +1,264 @@
+/* The MIT License (MIT)
+
+   Copyright (c) 2023 Anrui Liu <liuar6@gmail.com>
+
+   Permission is hereby granted, free of charge, to any person obtaining
+   a copy of this software and associated documentation files (the
+   “Software”), to deal in the Software without restriction, including
+   without limitation the rights to use, copy, modify, merge, publish,
+   distribute, sublicense, and/or sell copies of the Software, and to
+   permit persons to whom the Software is furnished to do so, subject to
+   the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND,
+   EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+   NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+   BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+   ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "fa.h"
+#include "khash.h"
+#include "ref.h"
+
+/* layout of fa.2bc: the header, n_targets entries, the names, then the data of each target, which is the 2 bits
+ * sequence followed by the N mask, the lower case mask, the positions of the exceptions and their upper case letters,
+ * each of them padded to 8 bytes */
+#define REF_MAGIC "SVT2BC\2\0"
+#define REF_CHUNK (1u << 20u)
+
+typedef struct ref_header_s{
+    char magic[8];
+    uint64_t n_targets;
+} ref_header_t;
+
+typedef struct ref_entry_s{
+    uint64_t name_offset;
+    uint64_t len;
+    uint64_t data_offset;
+    uint64_t n_exception;
+} ref_entry_t;
+
+#define ref_pad(n) (((n) + 7u) & ~(uint64_t) 7u)
+#define ref_seq_size(len) ref_pad(((uint64_t) (len) + 3u) / 4u)
+#define ref_mask_size(len) ref_pad(((uint64_t) (len) + 7u) / 8u)
+#define ref_data_size(len, n) (ref_seq_size(len) + 2 * ref_mask_size(len) + ref_pad(4 * (uint64_t) (n)) + ref_pad(n))
+#define ref_is_exception(c) (((c) & ~0x20) != 'A' && ((c) & ~0x20) != 'C' && ((c) & ~0x20) != 'G' && \
+                             ((c) & ~0x20) != 'T' && ((c) & ~0x20) != 'N')
+
+/* the names of the targets to their index, the keys point into the cache */
+KHASH_MAP_INIT_STR(ref, int32_t)
+
+static int ref_entry_ok(ref_t *ref, ref_entry_t *e){
+    /* whether the name and the data of e lie inside the cache, the name must end before the end of the cache */
+    if (e->name_offset >= ref->size || !memchr((char *) ref->base + e->name_offset, '\0', ref->size - e->name_offset)) return 0;
+    if (e->len > UINT32_MAX || e->n_exception > e->len || e->data_offset > ref->size) return 0;
+    return ref_data_size(e->len, e->n_exception) <= ref->size - e->data_offset;
+}
+
+static int ref_load(ref_t *ref){
+    /* set up the targets from the mapped file, returns -1 if it does not look like a cache, such as a truncated
+     * one, which is then rebuilt */
+    ref_header_t *h = ref->base;
+    if (ref->size < sizeof(ref_header_t) || memcmp(h->magic, REF_MAGIC, 8) != 0) return -1;
+    if (h->n_targets > INT32_MAX || h->n_targets > (ref->size - sizeof(ref_header_t)) / sizeof(ref_entry_t)) return -1;
+    ref_entry_t *e = (ref_entry_t *) (h + 1);
+    for (uint64_t i = 0; i < h->n_targets; ++i) if (!ref_entry_ok(ref, &e[i])) return -1;
+    ref->n_targets = h->n_targets;
+    ref->targets = calloc(ref->n_targets, sizeof(ref_target_t));
+    for (int32_t i = 0; i < ref->n_targets; ++i) {
+        uint8_t *data = (uint8_t *) ref->base + e[i].data_offset;
+        ref->targets[i].name = (char *) ref->base + e[i].name_offset;
+        ref->targets[i].len = e[i].len;
+        ref->targets[i].seq = data;
+        ref->targets[i].n_mask = data + ref_seq_size(e[i].len);
+        ref->targets[i].lower_mask = data + ref_seq_size(e[i].len) + ref_mask_size(e[i].len);
+        ref->targets[i].n_exception = e[i].n_exception;
+        ref->targets[i].exception_pos = (uint32_t *) (data + ref_seq_size(e[i].len) + 2 * ref_mask_size(e[i].len));
+        ref->targets[i].exception_base = (uint8_t *) ref->targets[i].exception_pos + ref_pad(4 * e[i].n_exception);
+    }
+    ref->index = kh_init(ref);
+    for (int32_t i = 0; i < ref->n_targets; ++i) {
+        int ret;
+        khiter_t k = kh_put(ref, ref->index, ref->targets[i].name, &ret);
+        if (ret) kh_val(ref->index, k) = i; /* the first of duplicated names wins */
+    }
+    return 0;
+}
+
+static void ref_pack(uint8_t *data, uint32_t len, uint32_t n_exception, const char *seq, uint32_t start, uint32_t n,
+                     uint32_t *i_exception){
+    /* the exceptions are appended in the order of the positions, i_exception counts those already written */
+    uint8_t *s = data, *n_mask = data + ref_seq_size(len), *lower_mask = n_mask + ref_mask_size(len);
+    uint32_t *exception_pos = (uint32_t *) (lower_mask + ref_mask_size(len));
+    uint8_t *exception_base = (uint8_t *) exception_pos + ref_pad(4 * (uint64_t) n_exception);
+    for (uint32_t i = 0; i < n; ++i) {
+        uint32_t pos = start + i;
+        uint8_t code = 0;
+        switch (seq[i] & ~0x20) {
+            case 'A': code = 0; break;
+            case 'C': code = 1; break;
+            case 'G': code = 2; break;
+            case 'T': code = 3; break;
+            default:
+                n_mask[pos>>3u] |= 1u << (pos&7u);
+                if (ref_is_exception(seq[i])) {
+                    exception_pos[*i_exception] = pos;
+                    exception_base[(*i_exception)++] = seq[i] & ~0x20;
+                }
+        }
+        s[pos>>2u] |= code << ((pos&3u)<<1u);
+        if (seq[i] & 0x20) lower_mask[pos>>3u] |= 1u << (pos&7u);
+    }
+}
+
+static size_t ref_build(void *base, fa_t *fa, uint32_t *n_exception){
+    /* returns the size of the cache, only counts it when base is NULL. the exceptions of each target are counted
+     * into n_exception by this first pass over the sequences, the fasta file is thus read twice for a cache */
+    size_t n = fa->fai->fv->size, offset = ref_pad(sizeof(ref_header_t) + n * sizeof(ref_entry_t));
+    ref_header_t *h = base;
+    ref_entry_t *e = base ? (ref_entry_t *) (h + 1) : NULL;
+    for (size_t i = 0; i < n; ++i) {
+        if (e) {
+            e[i].name_offset = offset;
+            strcpy((char *) base + offset, fa->fai->fv->data[i]->chrom);
+        }
+        offset += strlen(fa->fai->fv->data[i]->chrom) + 1;
+    }
+    offset = ref_pad(offset);
+    char *seq = NULL;
+    int32_t seq_len = 0;
+    for (size_t i = 0; i < n; ++i) {
+        uint32_t len = fa->fai->fv->data[i]->chrom_len, i_exception = 0;
+        if (e) {
+            e[i].len = len;
+            e[i].data_offset = offset;
+            e[i].n_exception = n_exception[i];
+        } else n_exception[i] = 0;
+        for (uint32_t start = 0; start < len; start += REF_CHUNK) {
+            uint32_t end = len - start > REF_CHUNK ? start + REF_CHUNK : len;
+            seq = extract_sequence(fa, fa->fai->fv->data[i]->chrom, start, end, '+', seq, &seq_len);
+            if (e) ref_pack((uint8_t *) base + offset, len, n_exception[i], seq, start, end - start, &i_exception);
+            else for (uint32_t j = 0; j < end - start; ++j) n_exception[i] += ref_is_exception(seq[j]);
+        }
+        offset += ref_data_size(len, n_exception[i]);
+    }
+    free(seq);
+    if (h) {
+        memcpy(h->magic, REF_MAGIC, 8);
+        h->n_targets = n;
+    }
+    return offset;
+}
+
+static int ref_map(ref_t *ref, const char *fn){
+    int fd = open(fn, O_RDONLY);
+    struct stat st;
+    if (fd < 0) return -1;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        close(fd);
+        return -1;
+    }
+    ref->size = st.st_size;
+    ref->base = mmap(NULL, ref->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ref->base == MAP_FAILED) return -1;
+    ref->mapped = 1;
+    if (ref_load(ref) == 0) return 0;
+    munmap(ref->base, ref->size);
+    free(ref->targets);
+    ref->targets = NULL;
+    return -1;
+}
+
+static int ref_save(const char *fn, fa_t *fa, uint32_t *n_exception, size_t size){
+    /* the cache is filled in a temporary file renamed at the end, so a run never sees a partial one */
+    char *tmp = malloc(strlen(fn) + 32);
+    sprintf(tmp, "%s.%d.tmp", fn, (int) getpid());
+    int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        free(tmp);
+        return -1;
+    }
+    void *base = MAP_FAILED;
+    if (ftruncate(fd, size) == 0) base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    int ret = -1;
+    if (base != MAP_FAILED) {
+        ref_build(base, fa, n_exception);
+        ret = munmap(base, size) == 0 && rename(tmp, fn) == 0 ? 0 : -1;
+    }
+    if (ret < 0) unlink(tmp);
+    free(tmp);
+    return ret;
+}
+
+ref_t *ref_open(const char *fa_name, const char *fai_name){
+    /* fa.2bc is (re)built if it is missing or older than the fasta file, and kept in anonymous memory if it
+     * cannot be written */
+    ref_t *ref = calloc(1, sizeof(ref_t));
+    char *fn = malloc(strlen(fa_name) + 5);
+    struct stat fa_st, st;
+    sprintf(fn, "%s.2bc", fa_name);
+    if (stat(fa_name, &fa_st) == 0 && stat(fn, &st) == 0 && st.st_mtime >= fa_st.st_mtime && ref_map(ref, fn) == 0) {
+        free(fn);
+        return ref;
+    }
+    fa_t *fa = fa_open(fa_name, fai_name);
+    uint32_t *n_exception = malloc(fa->fai->fv->size * sizeof(uint32_t));
+    size_t size = ref_build(NULL, fa, n_exception);
+    if (ref_save(fn, fa, n_exception, size) < 0 || ref_map(ref, fn) < 0) {
+        fprintf(stderr, "[ref] failed to write %s, the reference is packed in memory.\n", fn);
+        ref->size = size;
+        ref->base = mmap(NULL, ref->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        ref->mapped = ref->base != MAP_FAILED;
+        if (!ref->mapped && !(ref->base = calloc(1, ref->size))) {
+            fprintf(stderr, "[ref] failed to allocate %zu bytes for the reference.\n", ref->size);
+            exit(1);
+        }
+        ref_build(ref->base, fa, n_exception);
+        ref_load(ref);
+    }
+    free(n_exception);
+    fa_close(fa);
+    free(fn);
+    return ref;
+}
+
+void ref_close(ref_t *ref){
+    if (ref->mapped) munmap(ref->base, ref->size);
+    else free(ref->base);
+    if (ref->index) kh_destroy(ref, ref->index);
+    free(ref->targets);
+    free(ref);
+}
+
+ref_target_t *ref_target(ref_t *ref, const char *name){
+    khiter_t k = kh_get(ref, ref->index, name);
+    return k == kh_end(ref->index) ? NULL : &ref->targets[kh_val(ref->index, k)];
+}
+
+char ref_exception(const ref_target_t *t, uint32_t pos){
+    /* the upper case letter at a masked position, 'N' if it is not an exception */
+    uint32_t lo = 0, hi = t->n_exception;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (t->exception_pos[mid] < pos) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo < t->n_exception && t->exception_pos[lo] == pos ? (char) t->exception_base[lo] : 'N';
+}
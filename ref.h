@@ -0,0 +1,70 @@
+/* The MIT License (MIT)
+
+   Copyright (c) 2023 Anrui Liu <liuar6@gmail.com>
+
+   Permission is hereby granted, free of charge, to any person obtaining
+   a copy of this software and associated documentation files (the
+   “Software”), to deal in the Software without restriction, including
+   without limitation the rights to use, copy, modify, merge, publish,
+   distribute, sublicense, and/or sell copies of the Software, and to
+   permit persons to whom the Software is furnished to do so, subject to
+   the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND,
+   EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+   NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+   BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+   ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE.
+ */
+
+/* the reference packed with 2 bits per base, with a mask of the N (or any other letter than ACGT) and a mask of the
+ * lower cases. the letters of the mask other than N, such as the IUPAC codes, are kept in a sorted list of exceptions.
+ * it is built once from the fasta file into fa.2bc, which is mapped into memory by the later runs. */
+
+#ifndef SAMVT_REF_H
+#define SAMVT_REF_H
+
+#include <stdint.h>
+
+typedef struct ref_target_s{
+    char *name;
+    uint32_t len;
+    const uint8_t *seq;
+    const uint8_t *n_mask;
+    const uint8_t *lower_mask;
+    uint32_t n_exception;
+    const uint32_t *exception_pos;
+    const uint8_t *exception_base;
+} ref_target_t;
+
+typedef struct ref_s{
+    int32_t n_targets;
+    ref_target_t *targets;
+    struct kh_ref_s *index;
+    void *base;
+    size_t size;
+    int mapped;
+} ref_t;
+
+ref_t *ref_open(const char *fa_name, const char *fai_name);
+void ref_close(ref_t *ref);
+ref_target_t *ref_target(ref_t *ref, const char *name);
+char ref_exception(const ref_target_t *t, uint32_t pos);
+
+/* the base at pos, '?' beyond the end of the target */
+static inline char ref_base(const ref_target_t *t, uint32_t pos){
+    char c;
+    if (pos >= t->len) return '?';
+    if (t->n_mask[pos>>3u] >> (pos&7u) & 1u) c = t->n_exception ? ref_exception(t, pos) : 'N';
+    else c = "ACGT"[t->seq[pos>>2u] >> ((pos&3u)<<1u) & 3u];
+    if (t->lower_mask[pos>>3u] >> (pos&7u) & 1u) c |= 0x20;
+    return c;
+}
+
+#endif //SAMVT_REF_H
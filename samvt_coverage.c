@@ -54,19 +54,44 @@ static struct {
     char *fn;
     char *out;
     int bin_size;
+    int bin_mode;
     int library_type;
     int strand;
     int n_threads;
+    int mode;
+    size_t shard_mem;
+    int val_type;
+    int block_shift;
+    int verbose;
+    int no_stream;
+    int by_region;
+    int fragment;
+    int fill_insert;
 
     int select;
+    int stream;
+    int chunked;
 } parameter;
 
+#ifndef SAMVT_COVERAGE_CHUNK
+#define SAMVT_COVERAGE_CHUNK (4u<<20u)
+#endif
+
+/* the records of a job. when the bam file is read by chunks, they are left in chunk and decoded into batch by the
+ * worker, with only the fields used for counting. otherwise they are read straight into bam, and with --fragment,
+ * paired[i] tells that bam[i] and bam[i + 1] are the two mates of a fragment. tid and pos are the frontier of the job,
+ * nothing of it or of the jobs read after it lies before */
 typedef struct samvt_coverage_job_s{
+    bt_batch_t *batch;
+    bt_chunk_t chunk;
     bam1_t **bam;
+    uint8_t *paired;
     int size;
     int capacity;
     mt_buffer *bf;
     coverage_t *cov;
+    int32_t tid;
+    hts_pos_t pos;
 } samvt_coverage_job_t;
 
 samvt_coverage_job_t *samvt_coverage_job_init(int capacity){
@@ -74,23 +99,32 @@ samvt_coverage_job_t *samvt_coverage_job_init(int capacity){
     job = malloc(sizeof(*job));
     job->size = 0;
     job->capacity = capacity;
-    job->bam = malloc(sizeof(*job->bam) * capacity);
-    for (int i = 0; i < job->capacity; ++i) job->bam[i] = bam_init1();
+    job->batch = bt_batch_init(0);
+    memset(&job->chunk, 0, sizeof(bt_chunk_t));
+    job->bam = NULL;
+    job->paired = NULL;
+    if (!parameter.chunked) {
+        /* one more for the second mate read into the last slot */
+        job->bam = malloc(sizeof(*job->bam) * (capacity + 1));
+        for (int i = 0; i <= capacity; ++i) job->bam[i] = bam_init1();
+        job->paired = calloc(capacity, sizeof(uint8_t));
+    }
     return job;
 }
 
 void samvt_coverage_job_destroy(void *_job){
     samvt_coverage_job_t *job = _job;
-    for (int i = 0; i < job->capacity; ++i) bam_destroy1(job->bam[i]);
+    bt_batch_destroy(job->batch);
+    if (job->bam) for (int i = 0; i <= job->capacity; ++i) bam_destroy1(job->bam[i]);
     free(job->bam);
+    free(job->paired);
+    free(job->chunk.data);
     free(job);
 }
 
-
-int extract_coverage(bam1_t *b, coverage_t *cov){
+static int extract_selected(uint16_t flag){
     int select = parameter.select;
     if (select != SELECT_ALL){
-        uint16_t flag = b->core.flag;
         if ((flag & BAM_FPAIRED)) {
             if (select == SELECT_FIRST_REVERSE){
                 if (((flag & BAM_FREAD1) && !(flag & BAM_FREVERSE)) || ((flag & BAM_FREAD2) && (flag & BAM_FREVERSE))) return 0;
@@ -99,31 +133,236 @@ int extract_coverage(bam1_t *b, coverage_t *cov){
             }
         } else if ((select == SELECT_FIRST_REVERSE && !(flag & BAM_FREVERSE)) || (select == SELECT_FIRST_FORWARD && (flag & BAM_FREVERSE))) return 0;
     }
-    int pos=b->core.pos;
-    const uint32_t *cigar=bam_get_cigar(b);
-    int cigar_len=0;
-    int cigar_type=0;
-    for (int i=0; i<b->core.n_cigar; ++i){
-        cigar_len=bam_cigar_oplen(cigar[i]);
-        cigar_type=bam_cigar_type(bam_cigar_op(cigar[i]));
+    return 1;
+}
+
+static int extract_segments(const bt_read_t *r, uint32_t *seg, int *spliced){
+    /* fill seg with the start and end of the aligned segments of r, returns their number */
+    int pos=r->pos;
+    const uint32_t *cigar=r->cigar;
+    int n = 0;
+    for (int i=0; i<r->n_cigar; ++i){
+        int cigar_len=bam_cigar_oplen(cigar[i]);
+        int cigar_type=bam_cigar_type(bam_cigar_op(cigar[i]));
         if (cigar_type==2) pos+=cigar_len;
         if (cigar_type==3) {
-            coverage_update(cov, b->core.tid, pos, pos+cigar_len);
+            seg[n * 2] = pos;
+            seg[n * 2 + 1] = pos+cigar_len;
             pos+=cigar_len;
+            n++;
         }
+        if (bam_cigar_op(cigar[i]) == BAM_CREF_SKIP) *spliced = 1;
     }
+    return n;
+}
+
+static void extract_update(coverage_t *cov, int32_t tid, uint32_t *seg, int n, uint32_t clip_start, uint32_t clip_end){
+    uint32_t bin_counted=0; /* end of the bins already counted for this read */
+    for (int i=0; i<n; ++i){
+        uint32_t start = seg[i * 2] < clip_start ? clip_start : seg[i * 2];
+        uint32_t end = seg[i * 2 + 1] > clip_end ? clip_end : seg[i * 2 + 1];
+        if (start >= end) continue;
+        if (parameter.bin_size > 1 && parameter.bin_mode == COVERAGE_BIN_COUNT) {
+            /* a read is counted once in each bin even if several segments overlap the bin */
+            if (start < bin_counted) start = bin_counted;
+            if (start < end) coverage_update(cov, tid, start, end);
+            bin_counted = ((end-1)/parameter.bin_size+1)*parameter.bin_size;
+        } else coverage_update(cov, tid, start, end);
+    }
+}
+
+#define EXTRACT_SEGMENTS 64
+
+/* only the part of r inside [clip_start, clip_end) is added */
+int extract_coverage(const bt_read_t *r, coverage_t *cov, uint32_t clip_start, uint32_t clip_end){
+    if (!extract_selected(r->flag)) return 0;
+    uint32_t segs[EXTRACT_SEGMENTS * 2], *seg = r->n_cigar > EXTRACT_SEGMENTS ? malloc(r->n_cigar * 2 * sizeof(uint32_t)) : segs;
+    int spliced = 0;
+    extract_update(cov, r->tid, seg, extract_segments(r, seg, &spliced), clip_start, clip_end);
+    if (seg != segs) free(seg);
     return 0;
 }
 
+int extract_fragment(const bt_read_t *r1, const bt_read_t *r2, coverage_t *cov, uint32_t clip_start, uint32_t clip_end){
+    /* the mates r1 and r2 are counted as the union of their segments, so that their overlap is counted once. with
+     * --fill-insert, a fragment without splicing covers everything from its start to its end. the strand of the
+     * fragment is the one of r1 */
+    if (!extract_selected(r1->flag)) return 0;
+    uint32_t n_cigar = r1->n_cigar + r2->n_cigar;
+    uint32_t segs[EXTRACT_SEGMENTS * 2], *seg = n_cigar > EXTRACT_SEGMENTS ? malloc(n_cigar * 2 * sizeof(uint32_t)) : segs;
+    uint32_t merged[EXTRACT_SEGMENTS * 2], *m = n_cigar > EXTRACT_SEGMENTS ? malloc(n_cigar * 2 * sizeof(uint32_t)) : merged;
+    int spliced = 0;
+    int n1 = extract_segments(r1, seg, &spliced);
+    int n2 = extract_segments(r2, seg + n1 * 2, &spliced);
+    int n = 0;
+    if (parameter.fill_insert && !spliced && n1 && n2) {
+        m[0] = seg[0] < seg[n1 * 2] ? seg[0] : seg[n1 * 2];
+        m[1] = seg[n1 * 2 - 1] > seg[(n1 + n2) * 2 - 1] ? seg[n1 * 2 - 1] : seg[(n1 + n2) * 2 - 1];
+        n = 1;
+    } else for (int i = 0, j = n1; i < n1 || j < n1 + n2; ) {
+        /* both lists are sorted, take the segment starting first and merge it into the last one if they touch */
+        uint32_t *next = (j == n1 + n2 || (i < n1 && seg[i * 2] <= seg[j * 2])) ? &seg[i++ * 2] : &seg[j++ * 2];
+        if (n && next[0] <= m[n * 2 - 1]) {
+            if (next[1] > m[n * 2 - 1]) m[n * 2 - 1] = next[1];
+        } else {
+            m[n * 2] = next[0];
+            m[n * 2 + 1] = next[1];
+            n++;
+        }
+    }
+    extract_update(cov, r1->tid, m, n, clip_start, clip_end);
+    if (seg != segs) free(seg);
+    if (m != merged) free(m);
+    return 0;
+}
+
+static void samvt_coverage_unsorted(){
+    fprintf(stderr, "[samvt coverage] %s is not sorted by coordinate, rerun with --no-stream.\n", parameter.fn);
+    exit(1);
+}
+
+static void samvt_coverage_sorted(uint32_t *last_tid, hts_pos_t *last_pos, uint32_t tid, hts_pos_t pos){
+    /* when streaming, the input must really be sorted, otherwise blocks already written would be updated again */
+    if (tid < *last_tid || (tid == *last_tid && pos < *last_pos)) samvt_coverage_unsorted();
+    *last_tid = tid;
+    *last_pos = pos;
+}
+
 void *extract_coverage_mt(void *arg){
     samvt_coverage_job_t* j = arg;
-    for (int i = 0; i < j->size; ++i){
-        extract_coverage(j->bam[i], j->cov);
+    coverage_t *cov = coverage_shard_get(j->cov);
+    if (parameter.chunked) {
+        bt_batch_t *t = j->batch;
+        uint32_t last_tid = j->chunk.tid; /* unmapped reads at the end have tid -1 */
+        hts_pos_t last_pos = j->chunk.pos;
+        bt_batch_clear(t);
+        bt_batch_push_chunk(t, &j->chunk);
+        for (int i = 0; i < t->n; ++i) {
+            bt_read_t r = bt_read_batch(t, i);
+            if (parameter.stream) samvt_coverage_sorted(&last_tid, &last_pos, r.tid, r.pos);
+            extract_coverage(&r, cov, 0, UINT32_MAX);
+        }
+    } else for (int i = 0; i < j->size; ++i){
+        bt_read_t r1 = bt_read_bam(j->bam[i]);
+        if (j->paired[i]) {
+            bt_read_t r2 = bt_read_bam(j->bam[++i]);
+            extract_fragment(&r1, &r2, cov, 0, UINT32_MAX);
+        } else extract_coverage(&r1, cov, 0, UINT32_MAX);
     }
-    mt_buffer_put(j->bf, j);
+    coverage_shard_put(j->cov, cov);
+    if (j->bf) mt_buffer_put(j->bf, j);
+    return j;
+}
+
+struct extract_coverage_region_arg{
+    bt_region_t region;
+    coverage_t *cov;
+    mt_buffer *readers;
+};
+
+void *extract_coverage_region(void *_arg){
+    /* the regions are aligned to the blocks, so no two of them touch the same block and no lock is needed. a read
+     * crossing the boundary is returned by the iterators of both regions, but each of them only counts its own part */
+    struct extract_coverage_region_arg *arg = _arg;
+    bt_bam_t *r = mt_buffer_get(arg->readers);
+    bt_bam_query(r, &arg->region);
+    if (bt_bam_chunked(r)) {
+        /* the records are decoded straight from the blocks of the index */
+        bt_batch_t *t = bt_batch_init(0);
+        bt_chunk_t c;
+        memset(&c, 0, sizeof(bt_chunk_t));
+        while (bt_bam_read_chunk(r, &c, SAMVT_COVERAGE_CHUNK) == 0) {
+            bt_batch_clear(t);
+            bt_batch_push_chunk(t, &c);
+            for (int i = 0; i < t->n; ++i) {
+                bt_read_t rec = bt_read_batch(t, i);
+                extract_coverage(&rec, arg->cov, arg->region.beg, arg->region.end);
+            }
+        }
+        bt_batch_destroy(t);
+        free(c.data);
+    } else {
+        bam1_t *b = bam_init1();
+        while (bt_bam_next(r, b) == 0) {
+            bt_read_t rec = bt_read_bam(b);
+            extract_coverage(&rec, arg->cov, arg->region.beg, arg->region.end);
+        }
+        bam_destroy1(b);
+    }
+    mt_buffer_put(arg->readers, r);
     return NULL;
 }
 
+static int samvt_coverage_next(bt_bam_t *s, bam1_t *b){
+    static uint32_t last_tid = 0;
+    static hts_pos_t last_pos = 0;
+    if (bt_bam_next(s, b) != 0) return -1;
+    if (parameter.stream) samvt_coverage_sorted(&last_tid, &last_pos, b->core.tid, b->core.pos); /* unmapped reads at the end have tid -1 */
+    return 0;
+}
+
+static int samvt_coverage_next2(bt_bam_t *s, bam1_t *b1, bam1_t *b2){
+    /* returns 0 with a fragment in b1 and b2, 1 with a single read in b1 and -1 at the end. without --fragment,
+     * each read goes alone */
+    static uint32_t last_tid = 0;
+    static hts_pos_t last_pos = 0;
+    if (!parameter.fragment) return samvt_coverage_next(s, b1) == 0 ? 1 : -1;
+    int ret = bt_bam_next2(s, b1, b2);
+    int32_t tid;
+    hts_pos_t pos;
+    /* a record read behind another one may not be the frontier yet, as long as older mates are waiting */
+    if (parameter.stream && !bt_bam_pair_sorted(s)) samvt_coverage_unsorted();
+    if (ret >= 0 && parameter.stream && bt_bam_pair_frontier(s, &tid, &pos) == 0) samvt_coverage_sorted(&last_tid, &last_pos, tid, pos);
+    return ret;
+}
+
+static void samvt_coverage_frontier(bt_bam_t *s, int32_t *tid, hts_pos_t *pos){
+    /* (tid, pos) is given the start of the last read, the reads coming after it start at or after (tid, pos). with
+     * --fragment, the mates kept by bt_bam_next2 are taken into account */
+    if (parameter.fragment && bt_bam_pair_frontier(s, tid, pos) != 0) {
+        *tid = 0;
+        *pos = 0;
+    }
+}
+
+static void samvt_coverage_flush(coverage_bw_t *w, int32_t tid, hts_pos_t pos){
+    /* nothing will be added before (tid, pos) any more */
+    output_bw_flush(w, tid < 0 ? INT32_MAX : tid, pos);
+}
+
+static int samvt_coverage_fill(bt_bam_t *s, samvt_coverage_job_t *job){
+    /* read until the job is full, returns -1 at the end. with --fragment, the frontier is taken before reading, as
+     * the fragments do not come in the order of their starts */
+    static uint32_t last_tid = 0;
+    static hts_pos_t last_pos = 0;
+    int ret = 0;
+    job->size = 0;
+    if (parameter.chunked) {
+        /* the records inside the chunk are checked by the worker */
+        ret = bt_bam_read_chunk(s, &job->chunk, SAMVT_COVERAGE_CHUNK);
+        if (ret < 0) return -1;
+        job->size = job->chunk.n;
+        job->tid = job->chunk.tid;
+        job->pos = job->chunk.pos;
+        if (parameter.stream) {
+            samvt_coverage_sorted(&last_tid, &last_pos, job->chunk.tid, job->chunk.pos);
+            last_tid = job->chunk.last_tid;
+            last_pos = job->chunk.last_pos;
+        }
+        return 0;
+    }
+    if (parameter.fragment) samvt_coverage_frontier(s, &job->tid, &job->pos);
+    while (job->size + parameter.fragment < job->capacity && (ret = samvt_coverage_next2(s, job->bam[job->size], job->bam[job->size + 1])) >= 0) {
+        job->paired[job->size] = ret == 0;
+        job->size += ret == 0 ? 2 : 1;
+    }
+    if (!parameter.fragment && job->size) {
+        job->tid = job->bam[0]->core.tid;
+        job->pos = job->bam[0]->core.pos;
+    }
+    return ret < 0 ? -1 : 0;
+}
+
 static void parse_arg(int argc, char *argv[]);
 static void usage(char *msg);
 
@@ -134,23 +373,123 @@ int samvt_coverage(int argc, char *argv[]){
     if ((parameter.library_type == FR_FIRSTSTRAND && parameter.strand == STRAND_REVERSE) || (parameter.library_type == FR_SECONDSTRAND && parameter.strand == STRAND_FORWARD)) select = SELECT_FIRST_FORWARD;
     parameter.select=select;
     bt_bam_t *s = bt_bam_open(parameter.fn, parameter.n_threads);
-    coverage_t *cov = coverage_init(s->hdr->n_targets, s->hdr->target_name, s->hdr->target_len, 12);
-    if (parameter.n_threads == 0){
-        bam1_t *b1 = bam_init1();
-        while (bt_bam_next(s, b1) == 0) extract_coverage(b1, cov);
+    uint32_t block_shift = parameter.block_shift, mutex_shift = 1;
+    if (parameter.block_shift < 0) {
+        block_shift = coverage_auto_block_shift(s->hdr->n_targets, s->hdr->target_len, parameter.bin_size, bt_bam_sample_span(s, 10000));
+        mutex_shift = coverage_auto_mutex_shift(s->hdr->n_targets, s->hdr->target_len, parameter.bin_size, block_shift);
+        if (parameter.verbose) fprintf(stderr, "[samvt coverage] block shift: %u, mutex shift: %u.\n", block_shift, mutex_shift);
+    }
+    coverage_t *cov = coverage_init(s->hdr->n_targets, s->hdr->target_name, s->hdr->target_len, block_shift);
+    coverage_set_mutex_shift(cov, mutex_shift);
+    coverage_set_bin(cov, parameter.bin_size, parameter.bin_mode);
+    coverage_set_mode(cov, parameter.mode);
+    coverage_set_val_type(cov, parameter.val_type);
+    int by_region = parameter.by_region && parameter.n_threads && !parameter.fragment && bt_bam_index(s) == 0;
+    parameter.stream = !parameter.no_stream && !by_region && bt_bam_sorted(s);
+    mt_server *server = parameter.n_threads ? bt_bam_mt_server(s) : NULL;
+    parameter.chunked = !by_region && !parameter.fragment && bt_bam_chunked(s);
+    coverage_bw_t *w = output_bw_open(cov, parameter.out, server, parameter.stream);
+    if (parameter.shard_mem && (by_region || !parameter.n_threads || parameter.stream))
+        fprintf(stderr, "[samvt coverage] -m/--shard-mem is only used with -p when the input is not streamed, see -N/--no-stream, it is ignored.\n");
+    if (by_region){
+        int n_region;
+        bt_region_t *region = bt_bam_split(s, (1u<<block_shift) * parameter.bin_size, parameter.n_threads * 8, &n_region);
+        struct extract_coverage_region_arg *args = malloc(n_region * sizeof(*args));
+        mt_buffer *readers = mt_buffer_init();
+        for (int i = 0; i < parameter.n_threads; ++i) {
+            bt_bam_t *r = bt_bam_open(parameter.fn, 0);
+            bt_bam_index(r);
+            mt_buffer_put(readers, r);
+        }
+        mt_queue *q = mt_queue_init(server, parameter.n_threads * 2, 0, MT_QUEUE_MODE_IGNORED);
+        for (int i = 0; i < n_region; ++i){
+            args[i].region = region[i];
+            args[i].cov = cov;
+            args[i].readers = readers;
+            mt_queue_dispatch(q, extract_coverage_region, &args[i], NULL, NULL, 0);
+        }
+        mt_queue_dispatch_end(q);
+        mt_queue_wait(q, MT_FINISH);
+        mt_queue_destroy(q);
+        mt_buffer_destroy(readers, (void (*)(void *)) &bt_bam_close);
+        free(args);
+        free(region);
+    } else if (parameter.n_threads == 0 && parameter.chunked){
+        bt_batch_t *t = bt_batch_init(0);
+        bt_chunk_t c;
+        memset(&c, 0, sizeof(bt_chunk_t));
+        uint32_t last_tid = 0;
+        hts_pos_t last_pos = 0;
+        while (bt_bam_read_chunk(s, &c, SAMVT_COVERAGE_CHUNK) == 0) {
+            bt_batch_clear(t);
+            bt_batch_push_chunk(t, &c);
+            for (int i = 0; i < t->n; ++i) {
+                bt_read_t r = bt_read_batch(t, i);
+                if (parameter.stream) samvt_coverage_sorted(&last_tid, &last_pos, r.tid, r.pos); /* unmapped reads at the end have tid -1 */
+                extract_coverage(&r, cov, 0, UINT32_MAX);
+            }
+            if (parameter.stream) samvt_coverage_flush(w, t->tid[t->n - 1], t->pos[t->n - 1]);
+        }
+        bt_batch_destroy(t);
+        free(c.data);
+    } else if (parameter.n_threads == 0){
+        bam1_t *b1 = bam_init1(), *b2 = bam_init1();
+        int ret1;
+        int32_t tid;
+        hts_pos_t pos;
+        while ((ret1 = samvt_coverage_next2(s, b1, b2)) >= 0) {
+            bt_read_t r1 = bt_read_bam(b1);
+            if (ret1 == 0) {
+                bt_read_t r2 = bt_read_bam(b2);
+                extract_fragment(&r1, &r2, cov, 0, UINT32_MAX);
+            } else extract_coverage(&r1, cov, 0, UINT32_MAX);
+            if (parameter.stream) {
+                tid = b1->core.tid;
+                pos = b1->core.pos;
+                samvt_coverage_frontier(s, &tid, &pos);
+                samvt_coverage_flush(w, tid, pos);
+            }
+        }
         bam_destroy1(b1);
+        bam_destroy1(b2);
+    } else if (parameter.stream) {
+        /* jobs are received in the order of dispatching, the frontier of the oldest job in flight is the frontier */
+        int n_job = parameter.n_threads * 5, head = 0, n_flight = 0, ret1 = 0;
+        void *ret;
+        samvt_coverage_job_t **jobs = malloc(sizeof(*jobs) * n_job);
+        for (int i = 0; i < n_job; ++i) jobs[i] = samvt_coverage_job_init(10000);
+        mt_queue *q = mt_queue_init(server, n_job, n_job, MT_QUEUE_MODE_SERIAL);
+        coverage_mt(cov);
+        while (ret1 == 0){
+            while (n_flight && mt_queue_receive(q, &ret, n_flight < n_job) == 0) {
+                head = (head + 1) % n_job;
+                if (--n_flight) samvt_coverage_flush(w, jobs[head]->tid, jobs[head]->pos);
+            }
+            samvt_coverage_job_t *job = jobs[(head + n_flight) % n_job];
+            job->cov = cov;
+            job->bf = NULL;
+            ret1 = samvt_coverage_fill(s, job);
+            if (job->size == 0) break;
+            if (!n_flight) samvt_coverage_flush(w, job->tid, job->pos);
+            mt_queue_dispatch(q, extract_coverage_mt, job, NULL, NULL, 0);
+            n_flight++;
+        }
+        mt_queue_dispatch_end(q);
+        while (mt_queue_receive(q, &ret, 0) == 0);
+        mt_queue_destroy(q);
+        for (int i = 0; i < n_job; ++i) samvt_coverage_job_destroy(jobs[i]);
+        free(jobs);
     } else {
-        mt_queue *q = mt_queue_init(bt_bam_mt_server(s), parameter.n_threads * 8, 0, MT_QUEUE_MODE_IGNORED);
+        mt_queue *q = mt_queue_init(server, parameter.n_threads * 8, 0, MT_QUEUE_MODE_IGNORED);
         mt_buffer *bf = mt_buffer_init();
         for (int i = 0; i < parameter.n_threads * 5; ++i) mt_buffer_put(bf, samvt_coverage_job_init(10000));
         coverage_mt(cov);
+        if (parameter.shard_mem) coverage_shard(cov, parameter.n_threads, parameter.shard_mem);
         while(1){
-            int ret1;
             samvt_coverage_job_t *job = mt_buffer_get(bf);
-            job->size = 0;
             job->cov = cov;
             job->bf = bf;
-            while(job->size < job->capacity && (ret1=bt_bam_next(s, job->bam[job->size]))==0) ++job->size;
+            int ret1 = samvt_coverage_fill(s, job);
             mt_queue_dispatch(q, extract_coverage_mt, job, NULL, NULL, 0);
             if (ret1 != 0) {
                 mt_queue_dispatch_end(q);
@@ -160,9 +499,16 @@ int samvt_coverage(int argc, char *argv[]){
         mt_queue_wait(q, MT_FINISH);
         mt_queue_destroy(q);
         mt_buffer_destroy(bf, &samvt_coverage_job_destroy);
+        coverage_reduce(cov, server);
+    }
+    output_bw_close(w);
+    if (parameter.verbose && parameter.fragment) {
+        bt_pair_stat_t stat = bt_bam_pair_stat(s);
+        fprintf(stderr, "[samvt coverage] fragments: %lu, single reads: %lu, mates not found: %lu, most reads waiting for their mates: %zu.\n",
+                (unsigned long) stat.n_pairs, (unsigned long) stat.n_singles, (unsigned long) stat.n_orphans, stat.high_water);
     }
-    output_bw(cov, parameter.out, parameter.n_threads?bt_bam_mt_server(s):NULL);
     bt_bam_close(s);
+    if (parameter.verbose) fprintf(stderr, "[samvt coverage] peak memory of the coverage blocks: %.1f MB.\n", coverage_peak_mem(cov) / 1048576.0);
     coverage_destroy(cov);
     return 0;
 }
@@ -174,13 +520,22 @@ static void parse_arg(int argc, char *argv[]){
     parameter.fn = NULL;
     parameter.out = NULL;
     parameter.bin_size = 1;
+    parameter.bin_mode = COVERAGE_BIN_OVERLAP;
     parameter.library_type = FR_FIRSTSTRAND;
     parameter.strand = STRAND_ALL;
     parameter.n_threads = 0;
-
+    parameter.mode = COVERAGE_MODE_DIFF;
+    parameter.shard_mem = 0;
+    parameter.val_type = COVERAGE_VAL_DEFAULT;
+    parameter.block_shift = 12;
+    parameter.verbose = 0;
+    parameter.no_stream = 0;
+    parameter.by_region = 0;
+    parameter.fragment = 0;
+    parameter.fill_insert = 0;
 
     if (argc == 1) usage("");
-    const char *shortOptions = "ho:i:t:s:B:I:p:";
+    const char *shortOptions = "ho:i:t:s:B:b:I:p:A:m:C:NRvK:Ff";
     const struct option longOptions[] =
             {
                     { "help" , no_argument , NULL, 'h' },
@@ -189,8 +544,18 @@ static void parse_arg(int argc, char *argv[]){
                     { "library-type" , required_argument, NULL, 't' },
                     { "strand" , required_argument, NULL, 's' },
                     { "bin-size" , required_argument, NULL, 'B' },
+                    { "bin-mode" , required_argument, NULL, 'b' },
                     { "item-size" , required_argument, NULL, 'I' },
                     { "threads" , required_argument, NULL, 'p' },
+                    { "accumulate" , required_argument, NULL, 'A' },
+                    { "shard-mem" , required_argument, NULL, 'm' },
+                    { "counter" , required_argument, NULL, 'C' },
+                    { "no-stream" , no_argument, NULL, 'N' },
+                    { "by-region" , no_argument, NULL, 'R' },
+                    { "verbose" , no_argument, NULL, 'v' },
+                    { "block-shift" , required_argument, NULL, 'K' },
+                    { "fragment" , no_argument, NULL, 'F' },
+                    { "fill-insert" , no_argument, NULL, 'f' },
                     {NULL, 0, NULL, 0} ,  /* Required at end of array. */
             };
 
@@ -219,10 +584,49 @@ static void parse_arg(int argc, char *argv[]){
                 break;
             case 'B':
                 parameter.bin_size = strtol(optarg, NULL, 10);
+                if (parameter.bin_size < 1) usage("Invalid value for -B/--bin-size.");
+                break;
+            case 'b':
+                if (strcmp(optarg, "overlap") == 0) parameter.bin_mode = COVERAGE_BIN_OVERLAP;
+                else if (strcmp(optarg, "count") == 0) parameter.bin_mode = COVERAGE_BIN_COUNT;
+                else usage("Unknown value for -b/--bin-mode.");
                 break;
             case 'p':
                 parameter.n_threads = strtol(optarg, NULL, 10);
                 break;
+            case 'A':
+                if (strcmp(optarg, "diff") == 0) parameter.mode = COVERAGE_MODE_DIFF;
+                else if (strcmp(optarg, "base") == 0) parameter.mode = COVERAGE_MODE_BASE;
+                else usage("Unknown value for -A/--accumulate.");
+                break;
+            case 'm':
+                parameter.shard_mem = (size_t) strtol(optarg, NULL, 10) << 20u;
+                break;
+            case 'C':
+                if ((parameter.val_type = coverage_val_type(optarg)) < 0) usage("Unknown value for -C/--counter.");
+                break;
+            case 'N':
+                parameter.no_stream = 1;
+                break;
+            case 'R':
+                parameter.by_region = 1;
+                break;
+            case 'v':
+                parameter.verbose = 1;
+                break;
+            case 'K':
+                if (strcmp(optarg, "auto") == 0) parameter.block_shift = -1;
+                else {
+                    parameter.block_shift = strtol(optarg, NULL, 10);
+                    if (parameter.block_shift < 4 || parameter.block_shift > 20) usage("Invalid value for -K/--block-shift.");
+                }
+                break;
+            case 'F':
+                parameter.fragment = 1;
+                break;
+            case 'f':
+                parameter.fill_insert = 1;
+                break;
             default:
                 usage("Unknown parameter.");
         }
@@ -230,6 +634,7 @@ static void parse_arg(int argc, char *argv[]){
     if (parameter.fn == NULL) parameter.fn = "/dev/stdin";
     if (parameter.out == NULL) parameter.out = "/dev/stdout";
     if (argc != optind) usage("Unrecognized parameter");
+    if (parameter.fill_insert && !parameter.fragment) usage("-f/--fill-insert needs -F/--fragment.");
     if (show_help)    usage("");
 }
 
@@ -238,12 +643,30 @@ static void usage(char *msg)
     const char *usage_info = "Usage:  samvt coverage [options] --bam <alignment file> --bw <big wig file>\n \
 [options]\n\
 -i/--bam                       : bam alignment file. [required]\n\
+                                 sam is also accepted, - reads it from stdin, and with -p its lines are parsed by the \n\
+                                 threads.\n\
 -o/--bw                        : bigwig file for output. [required]\n\
 -h/--help                      : show help informations.\n\
 -t/--library-type              : library type, one of fr-firststrand or fr-secondstrand, default: fr-firststrand.\n\
 -s/--strand                    : strand on the genome used for coverage calculation.\n\
--B/--bin-size                  : bin size for coverage calculation (not implemented). \n\
--p/--threads                   : number of threads to use. \n\n\
+-B/--bin-size                  : bin size for coverage calculation, default: 1.\n\
+-b/--bin-mode                  : value of the bins, one of overlap (mean depth of the bin) or count (number of reads overlapping the bin), default: overlap.\n\
+-p/--threads                   : number of threads to use. \n\
+-A/--accumulate                : accumulation engine, one of diff (boundaries only) or base (every base), default: diff.\n\
+-m/--shard-mem                 : opt-in for unsorted input with -p, give each thread a private coverage shard using at \n\
+                                 most this many MB in total, blocks beyond the limit go to the shared locked coverage. \n\
+                                 sorted input is streamed without shards unless -N/--no-stream is given, default: 0 (disabled).\n\
+-C/--counter                   : counter type, one of u16, u32, float or double, default: double.\n\
+-N/--no-stream                 : keep the whole coverage in memory even if the bam header declares SO:coordinate, \n\
+                                 by default the blocks of sorted input are written and freed once no read can reach them.\n\
+-R/--by-region                 : with -p and an indexed bam, let each thread read its own regions of the genome through \n\
+                                 the index instead of decoding the file from a single reader.\n\
+-v/--verbose                   : report the peak memory used by the coverage blocks.\n\
+-K/--block-shift               : each block of the coverage holds 2^N bins, N is between 4 and 20 or auto to choose it \n\
+                                 from the target lengths and the reads at the beginning of the file, default: 12.\n\
+-F/--fragment                  : count the two mates of a pair as one fragment, so that their overlap is counted once. \n\
+                                 the mates are paired on the fly in coordinate-sorted input, -R/--by-region is ignored.\n\
+-f/--fill-insert               : with -F/--fragment, also count the insert between the mates of the unspliced pairs.\n\n\
 ";
     if (msg==NULL || msg[0] == '\0') fprintf(stderr, "%s", usage_info);
     else fprintf(stderr, "%s\n\n%s", msg, usage_info);
@@ -29,9 +29,14 @@
 #include <stdlib.h>
 #include <getopt.h>
 
+#include "htslib/kstring.h"
+
+#include "khash.h"
 #include "bam.h"
 #include "mt.h"
-#include "fa.h"
+#include "mt_buffer.h"
+#include "ref.h"
+#include "tsv.h"
 
 #include "common.h"
 #include "coverage.h"
@@ -43,26 +48,6 @@
 
 KHASH_MAP_INIT_STR(target, int);
 
-typedef struct {
-    double A;
-    double C;
-    double G;
-    double T;
-    double N;
-} cov2_val_t;
-
-typedef struct coverage2_s{
-    int32_t n_targets;
-    char **target_name;
-    uint32_t *target_len;
-    uint32_t coverage_block_shift;
-    uint32_t coverage_block_size;
-    cov2_val_t ***coverage_blocks;
-    int is_mt;
-    uint32_t coverage_mutex_shift;
-    pthread_mutex_t **coverage_block_mutexes;
-} coverage2_t;
-
 static struct {
     char *fn;
     char *fa;
@@ -73,18 +58,47 @@ static struct {
     double prop;
     int library_type;
     int n_threads;
+    int val_type;
+    int block_shift;
+    int storage;
+    int verbose;
+    int by_region;
+    int integer;
+    int bgzf;
+    int want_stream;
+    int stream;
+    int chunked;
 } parameter;
 
+#ifndef SAMVT_MUTATION_CHUNK
+#define SAMVT_MUTATION_CHUNK (4u<<20u)
+#endif
+
 static void parse_arg(int argc, char *argv[]);
 static void usage(char *msg);
-#define is_reverse(b) (((b)->core.flag&BAM_FREVERSE) != 0)
-#define is_mate_reverse(b) (((b)->core.flag & BAM_FMREVERSE) != 0)
-#define is_first(b) (((b)->core.flag & BAM_FREAD1) !=0u)
-#define is_second(b) (((b)->core.flag & BAM_FREAD2) !=0u)
+#define is_reverse(flag) (((flag) & BAM_FREVERSE) != 0)
+#define is_mate_reverse(flag) (((flag) & BAM_FMREVERSE) != 0)
+#define is_first(flag) (((flag) & BAM_FREAD1) !=0u)
+#define is_second(flag) (((flag) & BAM_FREAD2) !=0u)
 
-static char get_strand(bam1_t *b, int type) {
+static void format_mutation(kstring_t *s, const char *name, int32_t pos, char strand, char base, double *counts){
+    kputs(name, s);
+    kputc('\t', s);
+    tsv_put_uint(s, pos);
+    kputc('\t', s);
+    kputc(strand, s);
+    kputc('\t', s);
+    kputc(base, s);
+    for (int j = 0; j < COVERAGE_CHANNEL; ++j) {
+        kputc('\t', s);
+        tsv_put_count(s, counts[j], parameter.integer);
+    }
+    kputc('\n', s);
+}
+
+static char get_strand(uint16_t b, int type) {
     int is_paired = 0;
-    if ((((b)->core.flag & BAM_FPAIRED) != 0u)) is_paired = 1;
+    if (((b & BAM_FPAIRED) != 0u)) is_paired = 1;
     if (type == FR_FIRSTSTRAND) {
         if (is_paired) {
             if ((is_first(b) && is_reverse(b)) || (is_second(b) && !is_reverse(b)))
@@ -100,24 +114,143 @@ static char get_strand(bam1_t *b, int type) {
                 return '-';
         } else return ((is_reverse(b) ? '-' : '+'));
     } else if (type == FR_UNSTRANDED) return '.';
-    fprintf(stderr, "%d\t%d\n", type, b->core.flag);
+    fprintf(stderr, "%d\t%d\n", type, b);
     exit(1);
 }
 
-int extract_mutation(bam1_t *b, coverage2_t *cov){
-    char strand = get_strand(b, parameter.library_type);
-    int pos=b->core.pos, read_pos = 0;
-    const uint32_t *cigar=bam_get_cigar(b);
-    uint8_t *read_seq = bam_get_seq(b);
+/* the lines of the bed file to be reported */
+typedef struct samvt_bed_line_s{
+    bt_region_t region;
+    char strand;
+} samvt_bed_line_t;
+
+/* the intervals of the bed file merged and sorted by target and position, the ones of target i are
+ * region[first[i]] to region[first[i+1]-1] */
+typedef struct samvt_bed_s{
+    int32_t n_targets;
+    int *first;
+    bt_region_t *region;
+    int n_region;
+    samvt_bed_line_t *line;
+    int n_line;
+} samvt_bed_t;
+
+static samvt_bed_t *bed_targets = NULL;
+
+static int samvt_bed_cmp(const void *_a, const void *_b){
+    const bt_region_t *a = _a, *b = _b;
+    if (a->tid != b->tid) return a->tid < b->tid ? -1 : 1;
+    return a->beg < b->beg ? -1 : a->beg > b->beg;
+}
+
+static int samvt_bed_line_cmp(const void *_a, const void *_b){
+    return samvt_bed_cmp(&((const samvt_bed_line_t *) _a)->region, &((const samvt_bed_line_t *) _b)->region);
+}
+
+samvt_bed_t *samvt_bed_load(char *fn, kh_target_t *chrom2id, int32_t n_targets){
+    char line[4096];
+    char *item[7];
+    int m = 0, n = 0;
+    FILE *fp = fopen(fn, "r");
+    if (!fp) return NULL;
+    samvt_bed_t *bed = calloc(1, sizeof(samvt_bed_t));
+    while (fgets(line, 4096, fp)){
+        strsplit(line, item, 7, '\t');
+        if (!item[2]) continue;
+        khiter_t key = kh_get(target, chrom2id, item[0]);
+        if (key == kh_end(chrom2id)) continue;
+        if (bed->n_line == m) {
+            m = m ? m * 2 : 64;
+            bed->line = realloc(bed->line, m * sizeof(samvt_bed_line_t));
+        }
+        bed->line[bed->n_line].region.tid = kh_val(chrom2id, key);
+        bed->line[bed->n_line].region.beg = strtol(item[1], NULL, 10);
+        bed->line[bed->n_line].region.end = strtol(item[2], NULL, 10);
+        bed->line[bed->n_line].strand = item[5] ? item[5][0] : '+';
+        if (bed->line[bed->n_line].region.beg < bed->line[bed->n_line].region.end) bed->n_line++;
+    }
+    fclose(fp);
+    bed->region = malloc((bed->n_line ? bed->n_line : 1) * sizeof(bt_region_t));
+    for (int i = 0; i < bed->n_line; ++i) bed->region[i] = bed->line[i].region;
+    bed->n_region = bed->n_line;
+    qsort(bed->region, bed->n_region, sizeof(bt_region_t), samvt_bed_cmp);
+    for (int i = 0; i < bed->n_region; ++i){
+        if (n && bed->region[n - 1].tid == bed->region[i].tid && bed->region[n - 1].end >= bed->region[i].beg) {
+            if (bed->region[n - 1].end < bed->region[i].end) bed->region[n - 1].end = bed->region[i].end;
+        } else bed->region[n++] = bed->region[i];
+    }
+    bed->n_region = n;
+    bed->n_targets = n_targets;
+    bed->first = calloc(n_targets + 1, sizeof(int));
+    for (int i = 0; i < bed->n_region; ++i) bed->first[bed->region[i].tid + 1]++;
+    for (int32_t i = 0; i < n_targets; ++i) bed->first[i + 1] += bed->first[i];
+    return bed;
+}
+
+bt_region_t *samvt_bed_blocks(samvt_bed_t *bed, coverage2_t *cov, int *n_region){
+    /* the intervals widened to the blocks of cov and merged again, so that the regions never share a block */
+    bt_region_t *r = malloc(bed->n_region * sizeof(bt_region_t));
+    hts_pos_t size = cov->coverage_block_size;
+    *n_region = 0;
+    for (int i = 0; i < bed->n_region; ++i){
+        hts_pos_t target_len = cov->target_len[bed->region[i].tid];
+        hts_pos_t beg = bed->region[i].beg / size * size;
+        hts_pos_t end = (bed->region[i].end + size - 1) / size * size;
+        if (end > target_len) end = target_len;
+        if (beg >= end) continue;
+        if (*n_region && r[*n_region - 1].tid == bed->region[i].tid && r[*n_region - 1].end >= beg) {
+            if (r[*n_region - 1].end < end) r[*n_region - 1].end = end;
+            continue;
+        }
+        r[*n_region].tid = bed->region[i].tid;
+        r[*n_region].beg = beg;
+        r[*n_region].end = end;
+        (*n_region)++;
+    }
+    return r;
+}
+
+void samvt_bed_destroy(samvt_bed_t *bed){
+    free(bed->line);
+    free(bed->first);
+    free(bed->region);
+    free(bed);
+}
+
+static int samvt_bed_hit(samvt_bed_t *bed, const bt_read_t *r){
+    /* whether r overlaps an interval, its end is only computed when it does not start inside one */
+    int32_t tid = r->tid;
+    if (tid < 0 || tid >= bed->n_targets) return 0;
+    int lo = bed->first[tid], hi = bed->first[tid + 1];
+    hts_pos_t pos = r->pos;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (bed->region[mid].end <= pos) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo == bed->first[tid + 1]) return 0;
+    if (bed->region[lo].beg <= pos) return 1;
+    return bt_read_endpos(r) > bed->region[lo].beg;
+}
+
+/* only the part of r inside [clip_start, clip_end) is added */
+int extract_mutation(const bt_read_t *r, coverage2_t *cov, uint32_t clip_start, uint32_t clip_end){
+    if (bed_targets && !samvt_bed_hit(bed_targets, r)) return 0;
+    char strand = get_strand(r->flag, parameter.library_type);
+    int pos=r->pos, read_pos = 0;
+    const uint32_t *cigar=r->cigar;
+    uint8_t *read_seq = r->seq;
     int cigar_len=0;
     int cigar_type=0;
-    for (int i=0; i<b->core.n_cigar; ++i){
+    for (int i=0; i<r->n_cigar; ++i){
         cigar_len=bam_cigar_oplen(cigar[i]);
         cigar_type=bam_cigar_type(bam_cigar_op(cigar[i]));
         if (cigar_type==1) read_pos+=cigar_len;
         if (cigar_type==2) pos+=cigar_len;
         if (cigar_type==3) {
-            coverage2_update(cov, b->core.tid, pos, pos+cigar_len, strand == '-'?'-':'+', read_seq, read_pos);
+            uint32_t start = pos < clip_start ? clip_start : pos;
+            uint32_t end = pos+cigar_len > clip_end ? clip_end : pos+cigar_len;
+            if (start < end) coverage2_update(cov, r->tid, start, end, strand == '-'?'-':'+', read_seq, read_pos + (start - pos));
             pos+=cigar_len;
             read_pos+=cigar_len;
         }
@@ -125,67 +258,211 @@ int extract_mutation(bam1_t *b, coverage2_t *cov){
     return 0;
 }
 
+/* the records of a job. when the bam file is read by chunks, they are left in chunk and decoded into batch by the
+ * worker, with only the fields used for counting, otherwise they are read straight into bam. tid and pos are the
+ * start of its first record */
+typedef struct samvt_mutation_job_s{
+    bt_batch_t *batch;
+    bt_chunk_t chunk;
+    bam1_t **bam;
+    int size;
+    int capacity;
+    mt_buffer *bf;
+    coverage2_t *cov;
+    int32_t tid;
+    hts_pos_t pos;
+} samvt_mutation_job_t;
+
+samvt_mutation_job_t *samvt_mutation_job_init(int capacity){
+    samvt_mutation_job_t *job;
+    job = malloc(sizeof(*job));
+    job->size = 0;
+    job->capacity = capacity;
+    job->batch = bt_batch_init(1);
+    memset(&job->chunk, 0, sizeof(bt_chunk_t));
+    job->bam = NULL;
+    if (!parameter.chunked) {
+        job->bam = malloc(sizeof(*job->bam) * capacity);
+        for (int i = 0; i < capacity; ++i) job->bam[i] = bam_init1();
+    }
+    return job;
+}
+
+void samvt_mutation_job_destroy(void *_job){
+    samvt_mutation_job_t *job = _job;
+    bt_batch_destroy(job->batch);
+    free(job->chunk.data);
+    if (job->bam) for (int i = 0; i < job->capacity; ++i) bam_destroy1(job->bam[i]);
+    free(job->bam);
+    free(job);
+}
+
+static void samvt_mutation_sorted(uint32_t *last_tid, hts_pos_t *last_pos, uint32_t tid, hts_pos_t pos){
+    /* when streaming, the input must really be sorted, otherwise blocks already called would be updated again */
+    if (tid < *last_tid || (tid == *last_tid && pos < *last_pos)) {
+        fprintf(stderr, "[samvt mutation] %s is not sorted by coordinate, rerun without --stream.\n", parameter.fn);
+        exit(1);
+    }
+    *last_tid = tid;
+    *last_pos = pos;
+}
+
+void *extract_mutation_mt(void *arg){
+    samvt_mutation_job_t* j = arg;
+    if (parameter.chunked) {
+        bt_batch_t *t = j->batch;
+        uint32_t last_tid = j->chunk.tid; /* unmapped reads at the end have tid -1 */
+        hts_pos_t last_pos = j->chunk.pos;
+        bt_batch_clear(t);
+        bt_batch_push_chunk(t, &j->chunk);
+        for (int i = 0; i < t->n; ++i) {
+            bt_read_t r = bt_read_batch(t, i);
+            if (parameter.stream) samvt_mutation_sorted(&last_tid, &last_pos, r.tid, r.pos);
+            extract_mutation(&r, j->cov, 0, UINT32_MAX);
+        }
+    } else for (int i = 0; i < j->size; ++i){
+        bt_read_t r = bt_read_bam(j->bam[i]);
+        extract_mutation(&r, j->cov, 0, UINT32_MAX);
+    }
+    if (j->bf) mt_buffer_put(j->bf, j);
+    return j;
+}
+
+static void samvt_mutation_region(bt_bam_t *s, bt_region_t *region, coverage2_t *cov){
+    /* count the part inside region of the reads overlapping it, fetched through the index */
+    bt_bam_query(s, region);
+    if (bt_bam_chunked(s)) {
+        /* the records are decoded straight from the blocks of the index */
+        bt_batch_t *t = bt_batch_init(1);
+        bt_chunk_t c;
+        memset(&c, 0, sizeof(bt_chunk_t));
+        while (bt_bam_read_chunk(s, &c, SAMVT_MUTATION_CHUNK) == 0) {
+            bt_batch_clear(t);
+            bt_batch_push_chunk(t, &c);
+            for (int i = 0; i < t->n; ++i) {
+                bt_read_t r = bt_read_batch(t, i);
+                extract_mutation(&r, cov, region->beg, region->end);
+            }
+        }
+        bt_batch_destroy(t);
+        free(c.data);
+    } else {
+        bam1_t *b = bam_init1();
+        while (bt_bam_next(s, b) == 0) {
+            bt_read_t r = bt_read_bam(b);
+            extract_mutation(&r, cov, region->beg, region->end);
+        }
+        bam_destroy1(b);
+    }
+}
+
+struct extract_mutation_region_arg{
+    bt_region_t region;
+    coverage2_t *cov;
+    mt_buffer *readers;
+};
+
+void *extract_mutation_region(void *_arg){
+    /* the regions are aligned to the blocks, so each of them fills its own blocks without lock. a read crossing the
+     * boundary is returned by the iterators of both regions, but each of them only counts its own part */
+    struct extract_mutation_region_arg *arg = _arg;
+    bt_bam_t *r = mt_buffer_get(arg->readers);
+    samvt_mutation_region(r, &arg->region, arg->cov);
+    mt_buffer_put(arg->readers, r);
+    return NULL;
+}
+
 struct call_mutation_arg{
     coverage2_t *cov;
     int index_start;
     int index_end;
-    int32_t target_index;
+    int n_index;
+    int32_t target_index[2];
     int32_t target;
-    char strand;
-    fa_t *fa;
+    ref_target_t *ref;
     char *base2int;
-    FILE *out;
+    int release;
+    kstring_t str;
 };
 
+#define call_mutation_touched(cov, target_index, n_index, block_index) \
+    ((cov)->coverage_blocks[(target_index)[0]][block_index] || ((n_index) > 1 && (cov)->coverage_blocks[(target_index)[1]][block_index]))
+
+/* whether a position of the block may reach parameter.count, the others are not even loaded */
+#define call_mutation_deep(cov, target_index, block_index) ((cov)->coverage_block_depth[target_index][block_index] >= parameter.count)
+
 void *call_mutation(void *_args){
+    /* the hits are formatted into args->str, which is written out by the caller. with two target indexes, the
+     * strands are called together so that the hits come in the order of positions */
     struct call_mutation_arg *args = _args;
     coverage2_t *cov =  args->cov;
     int index_start = args->index_start;
     int index_end = args->index_end;
-    int32_t target_index = args->target_index;
+    int32_t *target_index = args->target_index;
     int32_t target = args->target;
     uint32_t coverage_block_size = cov->coverage_block_size;
     int32_t target_len = cov->target_len[target];
-    char *seq = NULL;
-    int seq_len = 0;
+    double *block_counts = malloc(args->n_index * coverage_block_size * COVERAGE_CHANNEL * sizeof(double));
     for (int block_index = index_start; block_index < index_end; block_index++){
-        if (cov->coverage_blocks[target_index][block_index] == NULL) continue;
+        if (!call_mutation_touched(cov, target_index, args->n_index, block_index)) continue;
         else {
+            int deep[2] = {0, 0}, n_deep = 0;
+            for (int k = 0; k < args->n_index; ++k) n_deep += deep[k] = call_mutation_deep(cov, target_index[k], block_index);
+            if (!n_deep) continue;
             int32_t coverage_block_start = block_index * coverage_block_size;
             int32_t coverage_block_end = (block_index + 1) * coverage_block_size;
-            if (args->fa) {
-                seq = extract_sequence(args->fa, cov->target_name[target], coverage_block_start, coverage_block_end, '+', NULL, &seq_len);
-            }
             if (coverage_block_end > target_len) coverage_block_end = target_len;
+            for (int k = 0; k < args->n_index; ++k)
+                if (deep[k]) coverage2_load(cov, target_index[k], block_index, block_counts + k * coverage_block_size * COVERAGE_CHANNEL);
             for (int i = coverage_block_start; i < coverage_block_end; ++i) {
-                double *counts = &(cov->coverage_blocks[target_index][block_index][i - coverage_block_start]);
-                double count_sum = counts[0] + counts[1] + counts[2] + counts[3] + counts[4];
-                double count_ref = 0;
-                if (count_sum < parameter.count) continue;
-                char base = '?';
-                if (seq) base = seq[i - coverage_block_start];
-                if (base != '?'){
-                    count_ref = counts[args->base2int[base]];
-                } else {
-                    count_ref = counts[0];
-                    for (int j = 1; j < 5; ++j) if (count_ref < counts[j]) count_ref = counts[j];
+                for (int k = 0; k < args->n_index; ++k) {
+                    if (!deep[k]) continue;
+                    double *counts = &block_counts[(k * coverage_block_size + i - coverage_block_start) * COVERAGE_CHANNEL];
+                    double count_sum = counts[0] + counts[1] + counts[2] + counts[3] + counts[4];
+                    double count_ref = 0;
+                    if (count_sum < parameter.count) continue;
+                    char base = '?';
+                    if (args->ref) base = ref_base(args->ref, i);
+                    if (base != '?'){
+                        count_ref = counts[args->base2int[base]];
+                    } else {
+                        count_ref = counts[0];
+                        for (int j = 1; j < 5; ++j) if (count_ref < counts[j]) count_ref = counts[j];
+                    }
+                    if ((1 - count_ref/count_sum) < parameter.prop) continue;
+                    format_mutation(&args->str, cov->target_name[target], i + 1, target_index[k] >= cov->n_targets ? '-' : '+', base, counts);
                 }
-                if ((1 - count_ref/count_sum) < parameter.prop) continue;
-                fprintf(args->out, "%s\t%d\t%c\t%c\t%f\t%f\t%f\t%f\t%f\n", cov->target_name[target] ,i+1, args->strand, base, counts[0], counts[1], counts[2], counts[3], counts[4]);
             }
             }
         }
-    if (seq) free(seq);
+    free(block_counts);
+    if (args->release)
+        for (int k = 0; k < args->n_index; ++k) coverage2_release(cov, target_index[k], index_start, index_end);
+    return _args;
+}
+
+struct call_mutation_mt_writer_arg{
+    mt_queue *q;
+    mt_buffer *b;
+    tsv_t *out;
+};
+
+void *call_mutation_mt_writer(void *_arg){
+    /* the ranges come back in the order of dispatching, so the output is the same as the serial one */
+    struct call_mutation_mt_writer_arg *arg = _arg;
+    struct call_mutation_arg *args;
+    while (mt_queue_receive(arg->q, (void *)&args, 0) == 0){
+        tsv_put(arg->out, &args->str);
+        mt_buffer_put(arg->b, args);
+    }
     return NULL;
 }
 
-struct {
-    double A;
-    double C;
-    double G;
-    double T;
-    double N;
-} test_mutation_null = {0, 0, 0, 0, 0};
+void call_mutation_arg_destroy(void *_args){
+    struct call_mutation_arg *args = _args;
+    free(args->str.s);
+    free(args);
+}
 
 struct test_mutation_arg{
     coverage2_t *cov;
@@ -193,9 +470,9 @@ struct test_mutation_arg{
     int32_t chromStart;
     int32_t chromEnd;
     char strand;
-    fa_t *fa;
     char *base2int;
-    FILE *out;
+    kstring_t *str;
+    tsv_t *out;
 };
 
 void *test_mutation(void *_args){
@@ -207,27 +484,251 @@ void *test_mutation(void *_args){
     int32_t target_index = (args->strand == '-') ? target + cov->n_targets : target;
     int block_index_start = chromStart / cov->coverage_block_size;
     int block_index_end = (chromEnd - 1) / cov->coverage_block_size + 1;
+    double *block_counts = malloc(cov->coverage_block_size * COVERAGE_CHANNEL * sizeof(double));
     for (int block_index = block_index_start; block_index < block_index_end; ++block_index){
         int32_t coverage_block_start = block_index * cov->coverage_block_size;
         int32_t coverage_block_end = (block_index + 1) * cov->coverage_block_size;
         int32_t start = chromStart > coverage_block_start ? chromStart : coverage_block_start;
         int32_t end = chromEnd > coverage_block_end ? coverage_block_end : chromEnd;
+        coverage2_load(cov, target_index, block_index, block_counts);
         for (int i = start; i < end; ++i){
-            double *counts;
-            if (cov->coverage_blocks[target_index][block_index] == NULL) counts = &test_mutation_null;
-            else counts = &(cov->coverage_blocks[target_index][block_index][i - coverage_block_start]);
-            fprintf(args->out, "%s\t%d\t%c\t%c\t%f\t%f\t%f\t%f\t%f\n", cov->target_name[target] ,i+1, args->strand, '?', counts[0], counts[1], counts[2], counts[3], counts[4]);
+            double *counts = &block_counts[(i - coverage_block_start) * COVERAGE_CHANNEL];
+            format_mutation(args->str, cov->target_name[target], i + 1, args->strand, '?', counts);
         }
+        tsv_put(args->out, args->str);
     }
+    free(block_counts);
     return NULL;
 }
 
+/* calls the blocks of cov in order and writes the hits out. samvt_mutation_call() can be called again and again with
+ * a frontier (tid, pos) that only moves forward, the blocks before it are called and, with release, freed. with a bed
+ * file, its lines ending before the frontier are reported instead. */
+typedef struct samvt_mutation_caller_s{
+    coverage2_t *cov;
+    tsv_t *out;
+    ref_target_t **ref; /* the reference of each target, NULL if it is not in the fasta file */
+    char *base2int;
+    samvt_bed_t *bed;
+    int n_index;
+    int release;
+    mt_queue *q;
+    mt_buffer *bf;
+    pthread_t mt_writer;
+    struct call_mutation_mt_writer_arg mt_writer_arg;
+    struct call_mutation_arg serial_args;
+    kstring_t str;
+    int32_t i; /* the target index being called, or the target when both strands are called together */
+    uint32_t block_index; /* its first block not called yet */
+    int i_line; /* the first bed line not reported yet */
+} samvt_mutation_caller_t;
+
+samvt_mutation_caller_t *samvt_mutation_caller_init(coverage2_t *cov, tsv_t *out, ref_t *ref, char *base2int, samvt_bed_t *bed, mt_server *s, int n_index, int release){
+    /* with s, the ranges are called by the workers and written out in order by a writer thread */
+    samvt_mutation_caller_t *c = calloc(1, sizeof(samvt_mutation_caller_t));
+    c->cov = cov;
+    c->out = out;
+    if (ref) {
+        c->ref = malloc(cov->n_targets * sizeof(ref_target_t *));
+        for (int32_t i = 0; i < cov->n_targets; ++i) c->ref[i] = ref_target(ref, cov->target_name[i]);
+    }
+    c->base2int = base2int;
+    c->bed = bed;
+    c->n_index = n_index;
+    c->release = release;
+    if (s && !bed) {
+        c->q = mt_queue_init(s, parameter.n_threads * 4, parameter.n_threads * 4, MT_QUEUE_MODE_SERIAL);
+        c->bf = mt_buffer_init();
+        for (int i = 0; i < parameter.n_threads * 10; ++i) {
+            struct call_mutation_arg *args = calloc(1, sizeof(struct call_mutation_arg));
+            mt_buffer_put(c->bf, args);
+        }
+        c->mt_writer_arg.q = c->q;
+        c->mt_writer_arg.b = c->bf;
+        c->mt_writer_arg.out = out;
+        pthread_create(&c->mt_writer, NULL, call_mutation_mt_writer, &c->mt_writer_arg);
+    }
+    return c;
+}
+
+static uint32_t samvt_mutation_limit(coverage2_t *cov, int32_t target, int32_t tid, uint32_t pos){
+    /* the number of blocks of target lying before the frontier */
+    uint32_t block_count = ((cov->target_len[target] - 1) >> cov->coverage_block_shift) + 1;
+    if (target != tid) return target < tid ? block_count : 0;
+    return (pos >> cov->coverage_block_shift) < block_count ? pos >> cov->coverage_block_shift : block_count;
+}
+
+static void samvt_mutation_call_blocks(samvt_mutation_caller_t *c, int32_t tid, uint32_t pos){
+    coverage2_t *cov = c->cov;
+    uint32_t n_needed_block = (1u << 17u) / cov->coverage_block_size + 1;
+    while (c->i < cov->n_targets * 2 / c->n_index) {
+        int32_t target_index[2] = {c->i, c->i + cov->n_targets};
+        int32_t target = c->i >= cov->n_targets ? c->i - cov->n_targets : c->i;
+        uint32_t block_count = ((cov->target_len[target] - 1) >> cov->coverage_block_shift) + 1;
+        uint32_t limit = samvt_mutation_limit(cov, target, tid, pos);
+        while (c->block_index < limit) {
+            uint32_t block_index_start = c->block_index, block_index_end = c->block_index, n_block = 0;
+            for (; block_index_end < limit && n_block < n_needed_block; ++block_index_end)
+                if (call_mutation_touched(cov, target_index, c->n_index, block_index_end)) n_block++;
+            c->block_index = block_index_end;
+            if (!n_block) continue;
+            struct call_mutation_arg *args = c->q ? mt_buffer_get(c->bf) : &c->serial_args;
+            args->cov = cov;
+            args->index_start = block_index_start;
+            args->index_end = block_index_end;
+            args->n_index = c->n_index;
+            args->target_index[0] = target_index[0];
+            args->target_index[1] = target_index[1];
+            args->target = target;
+            args->release = c->release;
+            args->ref = c->ref ? c->ref[target] : NULL;
+            args->base2int = c->base2int;
+            if (c->q) mt_queue_dispatch(c->q, call_mutation, args, NULL, NULL, 0);
+            else {
+                call_mutation(args);
+                tsv_put(c->out, &args->str);
+            }
+        }
+        if (limit < block_count) return;
+        c->i++;
+        c->block_index = 0;
+    }
+}
+
+static void samvt_mutation_call_lines(samvt_mutation_caller_t *c, int32_t tid, uint32_t pos){
+    coverage2_t *cov = c->cov;
+    samvt_bed_t *bed = c->bed;
+    while (c->i_line < bed->n_line) {
+        bt_region_t *r = &bed->line[c->i_line].region;
+        if (r->tid > tid || (r->tid == tid && r->end > pos)) break;
+        struct test_mutation_arg args;
+        args.cov = cov;
+        args.target = r->tid;
+        args.chromStart = r->beg;
+        args.chromEnd = r->end;
+        args.strand = bed->line[c->i_line].strand;
+        args.str = &c->str;
+        args.out = c->out;
+        test_mutation(&args);
+        c->i_line++;
+    }
+    if (!c->release) return;
+    /* the blocks before both the frontier and the next line are not needed any more */
+    if (c->i_line < bed->n_line) {
+        bt_region_t *r = &bed->line[c->i_line].region;
+        if (r->tid < tid || (r->tid == tid && r->beg < pos)) {
+            tid = r->tid;
+            pos = r->beg;
+        }
+    }
+    while (c->i < cov->n_targets) {
+        uint32_t block_count = ((cov->target_len[c->i] - 1) >> cov->coverage_block_shift) + 1;
+        uint32_t limit = samvt_mutation_limit(cov, c->i, tid, pos);
+        if (c->block_index < limit) {
+            coverage2_release(cov, c->i, c->block_index, limit);
+            coverage2_release(cov, c->i + cov->n_targets, c->block_index, limit);
+            c->block_index = limit;
+        }
+        if (limit < block_count) return;
+        c->i++;
+        c->block_index = 0;
+    }
+}
+
+void samvt_mutation_call(samvt_mutation_caller_t *c, int32_t tid, uint32_t pos){
+    if (c->bed) samvt_mutation_call_lines(c, tid, pos);
+    else samvt_mutation_call_blocks(c, tid, pos);
+}
+
+int samvt_mutation_caller_close(samvt_mutation_caller_t *c){
+    samvt_mutation_call(c, INT32_MAX, 0);
+    if (c->q) {
+        mt_queue_dispatch_end(c->q);
+        mt_queue_wait(c->q, MT_FINISH);
+        pthread_join(c->mt_writer, NULL);
+        mt_queue_destroy(c->q);
+        mt_buffer_destroy(c->bf, call_mutation_arg_destroy);
+    }
+    free(c->ref);
+    free(c->serial_args.str.s);
+    free(c->str.s);
+    free(c);
+    return 0;
+}
+
+static int samvt_mutation_next(bt_bam_t *s, bam1_t *b){
+    static uint32_t last_tid = 0;
+    static hts_pos_t last_pos = 0;
+    if (bt_bam_next(s, b) != 0) return -1;
+    if (parameter.stream) samvt_mutation_sorted(&last_tid, &last_pos, b->core.tid, b->core.pos); /* unmapped reads at the end have tid -1 */
+    return 0;
+}
+
+static void samvt_mutation_flush(samvt_mutation_caller_t *c, int32_t tid, hts_pos_t pos){
+    /* nothing will be added before (tid, pos) any more */
+    samvt_mutation_call(c, tid < 0 ? INT32_MAX : tid, pos);
+}
+
+static int samvt_mutation_fill(bt_bam_t *s, samvt_mutation_job_t *job){
+    /* read until the job is full, returns -1 at the end */
+    static uint32_t last_tid = 0;
+    static hts_pos_t last_pos = 0;
+    int ret = 0;
+    job->size = 0;
+    if (parameter.chunked) {
+        /* the records inside the chunk are checked by the worker */
+        if (bt_bam_read_chunk(s, &job->chunk, SAMVT_MUTATION_CHUNK) < 0) return -1;
+        job->size = job->chunk.n;
+        job->tid = job->chunk.tid;
+        job->pos = job->chunk.pos;
+        if (parameter.stream) {
+            samvt_mutation_sorted(&last_tid, &last_pos, job->chunk.tid, job->chunk.pos);
+            last_tid = job->chunk.last_tid;
+            last_pos = job->chunk.last_pos;
+        }
+        return 0;
+    }
+    while (job->size < job->capacity && (ret = samvt_mutation_next(s, job->bam[job->size])) == 0) job->size++;
+    if (job->size) {
+        job->tid = job->bam[0]->core.tid;
+        job->pos = job->bam[0]->core.pos;
+    }
+    return ret < 0 ? -1 : 0;
+}
+
 int samvt_mutation(int argc, char *argv[]){
     parse_arg(argc, argv);
     bt_bam_t *s = bt_bam_open(parameter.fn, parameter.n_threads);
-    fa_t *fa = NULL;
-    if (parameter.fa) fa = fa_open(parameter.fa, parameter.fai);
-    coverage2_t *cov = coverage2_init(s->hdr->n_targets, s->hdr->target_name, s->hdr->target_len, 12);
+    ref_t *ref = NULL;
+    if (parameter.fa) ref = ref_open(parameter.fa, parameter.fai);
+    uint32_t block_shift = parameter.block_shift, mutex_shift = 1;
+    if (parameter.block_shift < 0) {
+        block_shift = coverage_auto_block_shift(s->hdr->n_targets, s->hdr->target_len, 1, bt_bam_sample_span(s, 10000));
+        mutex_shift = coverage_auto_mutex_shift(s->hdr->n_targets, s->hdr->target_len, 1, block_shift);
+        if (parameter.verbose) fprintf(stderr, "[samvt mutation] block shift: %u, mutex shift: %u.\n", block_shift, mutex_shift);
+    }
+    coverage2_t *cov = coverage2_init(s->hdr->n_targets, s->hdr->target_name, s->hdr->target_len, block_shift);
+    coverage2_set_mutex_shift(cov, mutex_shift);
+    coverage2_set_val_type(cov, parameter.val_type);
+    coverage2_set_storage(cov, parameter.storage);
+    if (parameter.storage == COVERAGE_STORAGE_MMAP && cov->storage != COVERAGE_STORAGE_MMAP)
+        fprintf(stderr, "[samvt mutation] failed to reserve the memory of -S/--storage mmap, the blocks are used.\n");
+    kh_target_t *chrom2id = kh_init(target);
+    for (int i  = 0; i <  cov->n_targets; ++i){
+        int kh_ret;
+        khiter_t key = kh_put(target, chrom2id, cov->target_name[i], &kh_ret);
+        kh_val(chrom2id, key) = i;
+    }
+    if (parameter.bed) {
+        /* only the blocks overlapping the bed intervals are counted, and the other reads are skipped */
+        if (!(bed_targets = samvt_bed_load(parameter.bed, chrom2id, cov->n_targets))) {
+            fprintf(stderr, "[samvt mutation] failed to open %s.\n", parameter.bed);
+            exit(1);
+        }
+        for (int i = 0; i < bed_targets->n_region; ++i)
+            coverage2_set_mask(cov, bed_targets->region[i].tid, bed_targets->region[i].beg, bed_targets->region[i].end);
+        if (!bed_targets->n_region) coverage2_set_mask(cov, 0, 0, 0);
+    }
     char base2int[256];
     for (int i = 0; i < 256; ++i) base2int[i] = 4;
     base2int['a'] = 0;
@@ -238,72 +739,139 @@ int samvt_mutation(int argc, char *argv[]){
     base2int['G'] = 2;
     base2int['t'] = 3;
     base2int['T'] = 3;
-    if (parameter.n_threads == 0){
-        bam1_t *b1 = bam_init1();
-        while (bt_bam_next(s, b1) == 0) extract_mutation(b1, cov);
-        bam_destroy1(b1);
+    /* with an index, the reads overlapping the bed intervals are fetched region by region instead of reading the
+     * whole file, and with -R the genome is split into regions for the threads */
+    int n_region = 0;
+    bt_region_t *region = NULL;
+    int by_region = ((parameter.by_region && parameter.n_threads) || bed_targets) && bt_bam_index(s) == 0;
+    if (by_region) {
+        if (bed_targets) region = samvt_bed_blocks(bed_targets, cov, &n_region);
+        else region = bt_bam_split(s, cov->coverage_block_size, parameter.n_threads * 8, &n_region);
     }
-    FILE *out = fopen(parameter.out, "w");
-    if (!parameter.bed) {
-        for (int i = 0; i < cov->n_targets * 2; ++i) {
-            int target_index = i;
-            int target = target_index >= cov->n_targets ? target_index - cov->n_targets : target_index;
-            int block_count = ((cov->target_len[target] - 1) / cov->coverage_block_size) + 1;
-            int block_index_start = 0, block_index_end = 0;
-            int n_needed_block = (1u << 17u) / cov->coverage_block_size + 1;
-            int n_block = 0;
-            while (block_index_end < block_count) {
-                block_index_start = block_index_end;
-                n_block = 0;
-                while (block_index_end < block_count) {
-                    if (!cov->coverage_blocks[i][block_index_end++]) continue;
-                    if (n_block == n_needed_block) break;
-                    n_block++;
+    /* with -s and sorted input, the blocks behind the reads are called and freed on the way, both strands of a target
+     * are then called together, like with bgzf, where it is needed for the index. it is opt-in because the hits
+     * then come out in another order */
+    parameter.stream = parameter.want_stream && !by_region && bt_bam_sorted(s);
+    if (parameter.want_stream && !parameter.stream)
+        fprintf(stderr, "[samvt mutation] -s/--stream needs a bam sorted by coordinate and read as a whole, it is ignored.\n");
+    parameter.chunked = !by_region && bt_bam_chunked(s);
+    if (parameter.stream && bed_targets) qsort(bed_targets->line, bed_targets->n_line, sizeof(samvt_bed_line_t), samvt_bed_line_cmp);
+    tsv_t *out = tsv_open(parameter.out);
+    if (!out) {
+        fprintf(stderr, "[samvt mutation] failed to open %s.\n", parameter.out);
+        exit(1);
+    }
+    mt_server *server = parameter.n_threads ? bt_bam_mt_server(s) : NULL;
+    if (parameter.bgzf) tsv_bgzf(out, server, cov->n_targets, cov->target_name);
+    samvt_mutation_caller_t *caller = samvt_mutation_caller_init(cov, out, ref, base2int, bed_targets, server, (parameter.bgzf || parameter.stream) ? 2 : 1, parameter.stream);
+    if (by_region && parameter.n_threads){
+        struct extract_mutation_region_arg *args = malloc(n_region * sizeof(*args));
+        mt_buffer *readers = mt_buffer_init();
+        for (int i = 0; i < parameter.n_threads; ++i) {
+            bt_bam_t *r = bt_bam_open(parameter.fn, 0);
+            bt_bam_index(r);
+            mt_buffer_put(readers, r);
+        }
+        mt_queue *q = mt_queue_init(server, parameter.n_threads * 2, 0, MT_QUEUE_MODE_IGNORED);
+        for (int i = 0; i < n_region; ++i){
+            args[i].region = region[i];
+            args[i].cov = cov;
+            args[i].readers = readers;
+            mt_queue_dispatch(q, extract_mutation_region, &args[i], NULL, NULL, 0);
+        }
+        mt_queue_dispatch_end(q);
+        mt_queue_wait(q, MT_FINISH);
+        mt_queue_destroy(q);
+        mt_buffer_destroy(readers, (void (*)(void *)) &bt_bam_close);
+        free(args);
+        free(region);
+    } else if (by_region) {
+        for (int i = 0; i < n_region; ++i) samvt_mutation_region(s, &region[i], cov);
+        free(region);
+    } else if (parameter.n_threads == 0 && parameter.chunked){
+        bt_batch_t *t = bt_batch_init(1);
+        bt_chunk_t c;
+        memset(&c, 0, sizeof(bt_chunk_t));
+        uint32_t last_tid = 0;
+        hts_pos_t last_pos = 0;
+        while (bt_bam_read_chunk(s, &c, SAMVT_MUTATION_CHUNK) == 0) {
+            bt_batch_clear(t);
+            bt_batch_push_chunk(t, &c);
+            for (int i = 0; i < t->n; ++i) {
+                bt_read_t r = bt_read_batch(t, i);
+                if (parameter.stream) {
+                    samvt_mutation_sorted(&last_tid, &last_pos, r.tid, r.pos); /* unmapped reads at the end have tid -1 */
+                    samvt_mutation_flush(caller, r.tid, r.pos);
                 }
-                struct call_mutation_arg args;
-                args.cov = cov;
-                args.index_start = block_index_start;
-                args.index_end = block_index_end;
-                args.strand = (target_index == target) ? '+' : '-';
-                args.target_index = target_index;
-                args.target = target;
-                args.fa = fa;
-                args.out = out;
-                args.base2int = base2int;
-                call_mutation(&args);
+                extract_mutation(&r, cov, 0, UINT32_MAX);
             }
-
         }
-    } else {
-        kh_target_t *chrom2id = kh_init(target);
-        for (int i  = 0; i <  cov->n_targets; ++i){
-            int kh_ret;
-            khiter_t key = kh_put(target, chrom2id, cov->target_name[i], &kh_ret);
-            kh_val(chrom2id, key) = i;
+        bt_batch_destroy(t);
+        free(c.data);
+    } else if (parameter.n_threads == 0){
+        bam1_t *b1 = bam_init1();
+        while (samvt_mutation_next(s, b1) == 0) {
+            if (parameter.stream) samvt_mutation_flush(caller, b1->core.tid, b1->core.pos);
+            bt_read_t r = bt_read_bam(b1);
+            extract_mutation(&r, cov, 0, UINT32_MAX);
         }
-        char line[4096];
-        char *item[7];
-        FILE *bed = fopen(parameter.bed, "r");
-        while (fgets(line, 4096, bed)){
-            strsplit(line, item, 7, '\t');
-            struct test_mutation_arg args;
-            khiter_t key = kh_get(target, chrom2id, item[0]);
-            if (key == kh_end(chrom2id)) continue;
-            args.cov = cov;
-            args.target = kh_val(chrom2id, key);
-            args.chromStart = strtol(item[1], NULL, 10);
-            args.chromEnd = strtol(item[2], NULL, 10);
-            args.strand = item[5][0];
-            args.out = out;
-            test_mutation(&args);
+        bam_destroy1(b1);
+    } else if (parameter.stream) {
+        /* jobs are received in the order of dispatching, the first read of the oldest job in flight is the frontier */
+        int n_job = parameter.n_threads * 5, head = 0, n_flight = 0, ret1 = 0;
+        void *ret;
+        samvt_mutation_job_t **jobs = malloc(sizeof(*jobs) * n_job);
+        for (int i = 0; i < n_job; ++i) jobs[i] = samvt_mutation_job_init(10000);
+        mt_queue *q = mt_queue_init(server, n_job, n_job, MT_QUEUE_MODE_SERIAL);
+        coverage2_mt(cov);
+        while (ret1 == 0){
+            while (n_flight && mt_queue_receive(q, &ret, n_flight < n_job) == 0) {
+                head = (head + 1) % n_job;
+                if (--n_flight) samvt_mutation_flush(caller, jobs[head]->tid, jobs[head]->pos);
+            }
+            samvt_mutation_job_t *job = jobs[(head + n_flight) % n_job];
+            job->cov = cov;
+            job->bf = NULL;
+            ret1 = samvt_mutation_fill(s, job);
+            if (job->size == 0) break;
+            if (!n_flight) samvt_mutation_flush(caller, job->tid, job->pos);
+            mt_queue_dispatch(q, extract_mutation_mt, job, NULL, NULL, 0);
+            n_flight++;
+        }
+        mt_queue_dispatch_end(q);
+        while (mt_queue_receive(q, &ret, 0) == 0);
+        mt_queue_destroy(q);
+        for (int i = 0; i < n_job; ++i) samvt_mutation_job_destroy(jobs[i]);
+        free(jobs);
+    } else {
+        mt_queue *q = mt_queue_init(server, parameter.n_threads * 8, 0, MT_QUEUE_MODE_IGNORED);
+        mt_buffer *bf = mt_buffer_init();
+        for (int i = 0; i < parameter.n_threads * 5; ++i) mt_buffer_put(bf, samvt_mutation_job_init(10000));
+        coverage2_mt(cov);
+        while(1){
+            int ret1;
+            samvt_mutation_job_t *job = mt_buffer_get(bf);
+            job->cov = cov;
+            job->bf = bf;
+            ret1 = samvt_mutation_fill(s, job);
+            mt_queue_dispatch(q, extract_mutation_mt, job, NULL, NULL, 0);
+            if (ret1 != 0) {
+                mt_queue_dispatch_end(q);
+                break;
+            }
         }
-        kh_destroy(target, chrom2id);
-        fclose(bed);
+        mt_queue_wait(q, MT_FINISH);
+        mt_queue_destroy(q);
+        mt_buffer_destroy(bf, &samvt_mutation_job_destroy);
     }
-    fclose(out);
+    samvt_mutation_caller_close(caller);
+    kh_destroy(target, chrom2id);
+    if (bed_targets) samvt_bed_destroy(bed_targets);
+    tsv_close(out);
+    if (parameter.verbose) fprintf(stderr, "[samvt mutation] peak memory of the coverage blocks: %.1f MB.\n", coverage2_peak_mem(cov) / 1048576.0);
     coverage2_destroy(cov);
     bt_bam_close(s);
-    if (fa) fa_close(fa);
+    if (ref) ref_close(ref);
     return 0;
 }
 
@@ -319,10 +887,17 @@ static void parse_arg(int argc, char *argv[]){
     parameter.count = 50;
     parameter.library_type = FR_UNSTRANDED;
     parameter.n_threads = 0;
-
+    parameter.val_type = COVERAGE_VAL_DEFAULT;
+    parameter.block_shift = 12;
+    parameter.storage = COVERAGE_STORAGE_BLOCKS;
+    parameter.verbose = 0;
+    parameter.by_region = 0;
+    parameter.integer = 0;
+    parameter.bgzf = 0;
+    parameter.want_stream = 0;
 
     if (argc == 1) usage("");
-    const char *shortOptions = "ho:i:f:p:t:a:b:c:e:";
+    const char *shortOptions = "ho:i:f:p:t:a:b:c:e:C:RvK:S:Izs";
     const struct option longOptions[] =
             {
                     { "help" , no_argument , NULL, 'h' },
@@ -334,6 +909,14 @@ static void parse_arg(int argc, char *argv[]){
                     { "count" , required_argument, NULL, 'c' },
                     { "prop" , required_argument, NULL, 'e' },
                     { "threads" , required_argument, NULL, 'p' },
+                    { "counter" , required_argument, NULL, 'C' },
+                    { "by-region" , no_argument, NULL, 'R' },
+                    { "verbose" , no_argument, NULL, 'v' },
+                    { "block-shift" , required_argument, NULL, 'K' },
+                    { "storage" , required_argument, NULL, 'S' },
+                    { "integer" , no_argument, NULL, 'I' },
+                    { "bgzf" , no_argument, NULL, 'z' },
+                    { "stream" , no_argument, NULL, 's' },
                     {NULL, 0, NULL, 0} ,  /* Required at end of array. */
             };
 
@@ -370,6 +953,36 @@ static void parse_arg(int argc, char *argv[]){
             case 'p':
                 parameter.n_threads = strtol(optarg, NULL, 10);
                 break;
+            case 'C':
+                if ((parameter.val_type = coverage_val_type(optarg)) < 0) usage("Unknown value for -C/--counter.");
+                break;
+            case 'R':
+                parameter.by_region = 1;
+                break;
+            case 'v':
+                parameter.verbose = 1;
+                break;
+            case 'K':
+                if (strcmp(optarg, "auto") == 0) parameter.block_shift = -1;
+                else {
+                    parameter.block_shift = strtol(optarg, NULL, 10);
+                    if (parameter.block_shift < 4 || parameter.block_shift > 20) usage("Invalid value for -K/--block-shift.");
+                }
+                break;
+            case 'S':
+                if (strcmp(optarg, "blocks") == 0) parameter.storage = COVERAGE_STORAGE_BLOCKS;
+                else if (strcmp(optarg, "mmap") == 0) parameter.storage = COVERAGE_STORAGE_MMAP;
+                else usage("Unknown value for -S/--storage.");
+                break;
+            case 'I':
+                parameter.integer = 1;
+                break;
+            case 'z':
+                parameter.bgzf = 1;
+                break;
+            case 's':
+                parameter.want_stream = 1;
+                break;
             default:
                 usage("Unknown parameter.");
         }
@@ -389,14 +1002,34 @@ static void usage(char *msg)
     const char *usage_info = "Usage:  samvt mutation [options] --bam <alignment file> --bw <big wig file>\n \
 [options]\n\
 -i/--bam                       : bam alignment file. [required]\n\
+                                 sam is also accepted, - reads it from stdin, and with -p its lines are parsed by the \n\
+                                 threads.\n\
 -o/--out                       : tsv file for output. [required]\n\
--a/--fa                        : use the reference fasta file to determine variant bases\n\
+-a/--fa                        : use the reference fasta file to determine variant bases, packed into fa.2bc on the first use.\n\
 -h/--help                      : show help informations.\n\
--t/--library-type              : library type, one of fr-firststrand or fr-secondstrand, default: fr-firststrand.\n\
--b/--bed                       : exclude the position not specified by bed file.\n\
+-t/--library-type              : library type, one of fr-firststrand or fr-secondstrand, the reads are counted \n\
+                                 without strand when it is not given, default: unstranded.\n\
+-b/--bed                       : only count and report the positions in the intervals of the bed file, if the bam is \n\
+                                 indexed, only the reads overlapping the intervals are read. with -s, the intervals \n\
+                                 are reported in the order of the coordinates instead of the order of the file.\n\
 -c/--count                     : exclude the position with lower coverage.\n\
 -e/--prop                      : exclude the position with lower proportion of variants.\n\
--p/--threads                   : number of threads to use (not implemented). \n\n\
+-p/--threads                   : number of threads to use. \n\
+-C/--counter                   : counter type, one of u16, u32, float or double, default: double.\n\
+-R/--by-region                 : with -p and an indexed bam, let each thread read its own regions of the genome through \n\
+                                 the index instead of decoding the file from a single reader.\n\
+-v/--verbose                   : report the peak memory used by the coverage blocks.\n\
+-K/--block-shift               : each block of the coverage holds 2^N bases, N is between 4 and 20 or auto to choose it \n\
+                                 from the target lengths and the reads at the beginning of the file, default: 12.\n\
+-S/--storage                   : storage of the counters, one of blocks (allocated when touched) or mmap (a single \n\
+                                 reserved range for all targets and strands, backed by huge pages if available), \n\
+                                 default: blocks.\n\
+-I/--integer                   : print the counts as integers instead of fixed-point numbers.\n\
+-z/--bgzf                      : compress the output with bgzf using the threads of -p and index it with tabix as \n\
+                                 <out>.tbi, the two strands are then sorted together by position.\n\
+-s/--stream                    : for a bam sorted by coordinate, report and free the blocks once no read can reach them. \n\
+                                 the hits of both strands then come interleaved by position, while by default the hits \n\
+                                 of the forward strand are reported before the ones of the reverse strand.\n\n\
 ";
     if (msg==NULL || msg[0] == '\0') fprintf(stderr, "%s", usage_info);
     else fprintf(stderr, "%s\n\n%s", msg, usage_info);
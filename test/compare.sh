@@ -0,0 +1,123 @@
+#!/bin/sh
+# The MIT License (MIT)
+#
+# Copyright (c) 2023 Anrui Liu <liuar6@gmail.com>
+#
+# Permission is hereby granted, free of charge, to any person obtaining
+# a copy of this software and associated documentation files (the
+# “Software”), to deal in the Software without restriction, including
+# without limitation the rights to use, copy, modify, merge, publish,
+# distribute, sublicense, and/or sell copies of the Software, and to
+# permit persons to whom the Software is furnished to do so, subject to
+# the following conditions:
+#
+# The above copyright notice and this permission notice shall be
+# included in all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND,
+# EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+# MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+# NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+# BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+# ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+# CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+
+# run samvt coverage and samvt mutation on the fixture of test/data with the options that must not change the
+# result (streaming, threads, regions read through the index, storage) and compare each run with the plain serial one.
+#
+# usage: test/compare.sh [samvt binary, default: samvt on the PATH]
+#
+# the bigwig files are compared base by base through bigWigToBedGraph when it is on the PATH, byte by byte otherwise.
+# the runs reading through the index (-R, -b on an indexed bam) need samtools to build the bam, they are skipped
+# without it. the output of samvt mutation -s, -R and -b on a bam is compared after sorting, as its order differs.
+
+SAMVT=${1:-samvt}
+DATA=$(cd "$(dirname "$0")/data" && pwd)
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+FAIL=0
+
+# the reference is copied so that fa.2bc is not written into the tree
+cp "$DATA/ref.fa" "$DATA/ref.fa.fai" "$TMP/"
+SAM="$DATA/reads.sam"
+BAM=
+if command -v samtools >/dev/null 2>&1; then
+    samtools view -b -o "$TMP/reads.bam" "$SAM" && samtools index "$TMP/reads.bam" && BAM="$TMP/reads.bam"
+fi
+[ -n "$BAM" ] || echo "samtools not found, the runs through the index are skipped."
+
+bw_dump() {
+    # one line per base, so that the splitting of the intervals does not matter
+    if command -v bigWigToBedGraph >/dev/null 2>&1; then
+        bigWigToBedGraph "$1" /dev/stdout | awk '{for (i = $2; i < $3; ++i) print $1 "\t" i "\t" $4}'
+    else
+        cat "$1"
+    fi
+}
+
+check() {
+    # check <name> <expected> <got>
+    if cmp -s "$2" "$3"; then
+        echo "ok    $1"
+    else
+        echo "FAIL  $1"
+        FAIL=1
+    fi
+}
+
+coverage() {
+    # coverage <name> <options of the reference run> <input of the run> <options of the run>, the reference run
+    # reads the sam file
+    if ! "$SAMVT" coverage -i "$SAM" -o "$TMP/a.bw" $2 2>"$TMP/log" || ! "$SAMVT" coverage -i "$3" -o "$TMP/b.bw" $4 2>>"$TMP/log"; then
+        echo "FAIL  coverage $1"
+        cat "$TMP/log"
+        FAIL=1
+        return
+    fi
+    bw_dump "$TMP/a.bw" > "$TMP/a.txt"
+    bw_dump "$TMP/b.bw" > "$TMP/b.txt"
+    check "coverage $1" "$TMP/a.txt" "$TMP/b.txt"
+}
+
+mutation() {
+    # mutation <name> <options of the reference run> <input of the run> <options of the run> [sort], the reference
+    # run reads the sam file
+    if ! "$SAMVT" mutation -i "$SAM" -o "$TMP/a.tsv" -a "$TMP/ref.fa" -c 1 -e 0 $2 2>"$TMP/log" ||
+       ! "$SAMVT" mutation -i "$3" -o "$TMP/b.tsv" -a "$TMP/ref.fa" -c 1 -e 0 $4 2>>"$TMP/log"; then
+        echo "FAIL  mutation $1"
+        cat "$TMP/log"
+        FAIL=1
+        return
+    fi
+    if [ -n "$5" ]; then
+        sort "$TMP/a.tsv" > "$TMP/a.txt"
+        sort "$TMP/b.tsv" > "$TMP/b.txt"
+        check "mutation $1" "$TMP/a.txt" "$TMP/b.txt"
+    else
+        check "mutation $1" "$TMP/a.tsv" "$TMP/b.tsv"
+    fi
+}
+
+for extra in "" "-t fr-secondstrand -s reverse" "-A base" "-C u32" "-F" "-F -f"; do
+    for opt in "-N" "-p 3" "-p 3 -N" "-p 3 -N -m 1"; do
+        coverage "[$extra] vs [$extra $opt]" "$extra" "$SAM" "$extra $opt"
+    done
+    if [ -n "$BAM" ]; then
+        coverage "[$extra] vs bam [$extra]" "$extra" "$BAM" "$extra"
+        coverage "[$extra] vs bam [$extra -p 3 -R]" "$extra" "$BAM" "$extra -p 3 -R"
+    fi
+done
+
+for extra in "" "-t fr-firststrand" "-b $DATA/regions.bed"; do
+    mutation "[$extra] vs [$extra -p 3]" "$extra" "$SAM" "$extra -p 3"
+    mutation "[$extra] vs [$extra -S mmap]" "$extra" "$SAM" "$extra -S mmap"
+    mutation "[$extra] vs [$extra -s]" "$extra" "$SAM" "$extra -s" sort
+    mutation "[$extra] vs [$extra -p 3 -s]" "$extra" "$SAM" "$extra -p 3 -s" sort
+    if [ -n "$BAM" ]; then
+        mutation "[$extra] vs bam [$extra]" "$extra" "$BAM" "$extra" sort
+        mutation "[$extra] vs bam [$extra -p 3 -R]" "$extra" "$BAM" "$extra -p 3 -R" sort
+    fi
+done
+
+exit $FAIL
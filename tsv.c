@@ -0,0 +1,220 @@
+/* The MIT License (MIT)
+
+   Copyright (c) 2023 Anrui Liu <liuar6@gmail.com>
+
+   Permission is hereby granted, free of charge, to any person obtaining
+   a copy of this software and associated documentation files (the
+   “Software”), to deal in the Software without restriction, including
+   without limitation the rights to use, copy, modify, merge, publish,
+   distribute, sublicense, and/or sell copies of the Software, and to
+   permit persons to whom the Software is furnished to do so, subject to
+   the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND,
+   EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+   NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+   BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+   ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "htslib/bgzf.h"
+#include "htslib/tbx.h"
+#include "khash.h"
+
+#include "tsv.h"
+
+KHASH_MAP_INIT_STR(tsv, int32_t)
+
+static const char tsv_digits[201] =
+        "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+        "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+        "8081828384858687888990919293949596979899";
+
+int tsv_put_uint(kstring_t *s, uint64_t v){
+    char buf[20];
+    char *p = buf + 20;
+    while (v >= 100) {
+        const char *d = tsv_digits + (v % 100) * 2;
+        v /= 100;
+        *--p = d[1];
+        *--p = d[0];
+    }
+    if (v >= 10) {
+        *--p = tsv_digits[v * 2 + 1];
+        *--p = tsv_digits[v * 2];
+    } else *--p = (char)('0' + v);
+    return kputsn(p, buf + 20 - p, s);
+}
+
+/* the counts are whole numbers unless they come from a float counter that lost precision, so they are
+ * printed as integers with the ".000000" of "%f" appended, the other values go through ksprintf. with
+ * integer, only the integer part is printed. */
+int tsv_put_count(kstring_t *s, double v, int integer){
+    if (v >= 0 && v < 9007199254740992.0) {
+        uint64_t u = (uint64_t) v;
+        if (integer) return tsv_put_uint(s, (uint64_t) (v + 0.5));
+        if ((double) u == v) {
+            if (tsv_put_uint(s, u) < 0) return -1;
+            return kputsn(".000000", 7, s);
+        }
+    } else if (integer) return ksprintf(s, "%.0f", v);
+    return ksprintf(s, "%f", v);
+}
+
+struct tsv_s{
+    char *fn;
+    int fd;
+    kstring_t buf;
+    BGZF *fp;
+    hts_idx_t *idx;
+    int sorted;
+    khash_t(tsv) *tid;
+    int32_t n_targets;
+    char **target_name;
+    int32_t last_tid;
+    hts_pos_t last_beg;
+};
+
+tsv_t *tsv_open(const char *fn){
+    tsv_t *w = calloc(1, sizeof(tsv_t));
+    w->fd = open(fn, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (w->fd < 0) {
+        free(w);
+        return NULL;
+    }
+    w->fn = strdup(fn);
+    return w;
+}
+
+/* write out the buffer if it holds at least min bytes */
+static int tsv_flush(tsv_t *w, size_t min){
+    size_t off = 0;
+    if (w->buf.l < min || w->buf.l == 0) return 0;
+    while (off < w->buf.l) {
+        ssize_t n = write(w->fd, w->buf.s + off, w->buf.l - off);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        off += n;
+    }
+    w->buf.l = 0;
+    return 0;
+}
+
+/* must be called before anything is put, s may be NULL to compress in the calling thread. the index is saved as
+ * fn.tbi by tsv_close() */
+tsv_t *tsv_bgzf(tsv_t *w, mt_server *s, int32_t n_targets, char **target_name){
+    int ret;
+    w->fp = bgzf_dopen(w->fd, "w");
+    if (s) bgzf_thread_pool(w->fp, (struct hts_tpool *) s, 256);
+    w->n_targets = n_targets;
+    w->target_name = target_name;
+    w->tid = kh_init(tsv);
+    for (int32_t i = 0; i < n_targets; ++i) {
+        khiter_t k = kh_put(tsv, w->tid, target_name[i], &ret);
+        kh_val(w->tid, k) = i;
+    }
+    w->idx = hts_idx_init(n_targets, HTS_FMT_TBI, bgzf_tell(w->fp), 14, 5);
+    w->sorted = 1;
+    w->last_tid = -1;
+    w->last_beg = -1;
+    return w;
+}
+
+static int32_t tsv_tid(tsv_t *w, char *name, size_t len){
+    khiter_t k;
+    int32_t tid;
+    if (w->last_tid >= 0 && strncmp(w->target_name[w->last_tid], name, len) == 0
+        && w->target_name[w->last_tid][len] == '\0') return w->last_tid;
+    name[len] = '\0';
+    k = kh_get(tsv, w->tid, name);
+    tid = k == kh_end(w->tid) ? -1 : kh_val(w->tid, k);
+    name[len] = '\t';
+    return tid;
+}
+
+/* a line never crosses two blocks, and the offset after it is pushed to the index like in tbx_index(). the index
+ * is given up at the first line out of order, but it is only destroyed after bgzf_close(), since the threads of
+ * the BGZF may still push the cached lines into it */
+static int tsv_put_bgzf(tsv_t *w, kstring_t *s){
+    char *p = s->s, *end = s->s + s->l;
+    while (p < end) {
+        char *eol = memchr(p, '\n', end - p);
+        size_t len = eol ? eol - p + 1 : end - p;
+        if (bgzf_flush_try(w->fp, len) < 0 || bgzf_write(w->fp, p, len) < 0) return -1;
+        if (w->sorted) {
+            char *tab = memchr(p, '\t', len);
+            int32_t tid = tab ? tsv_tid(w, p, tab - p) : -1;
+            hts_pos_t beg = tab ? strtoll(tab + 1, NULL, 10) - 1 : -1;
+            if (tid < 0 || beg < 0 || tid < w->last_tid || (tid == w->last_tid && beg < w->last_beg)) {
+                fprintf(stderr, "[tsv] %s is not sorted, the index is not built.\n", w->fn);
+                w->sorted = 0;
+            } else {
+                if (bgzf_idx_push(w->fp, w->idx, tid, beg, beg + 1, bgzf_tell(w->fp), 1) < 0) return -1;
+                w->last_tid = tid;
+                w->last_beg = beg;
+            }
+        }
+        p += len;
+    }
+    return 0;
+}
+
+/* append the whole lines in s to the output, s is emptied */
+int tsv_put(tsv_t *w, kstring_t *s){
+    int ret;
+    if (w->fp) ret = tsv_put_bgzf(w, s);
+    else {
+        ret = kputsn(s->s, s->l, &w->buf) < 0 ? -1 : 0;
+        if (ret == 0) ret = tsv_flush(w, TSV_BUFFER_SIZE);
+    }
+    s->l = 0;
+    return ret;
+}
+
+int tsv_close(tsv_t *w){
+    int ret = 0;
+    if (w->fp) {
+        if (bgzf_flush(w->fp) < 0) ret = -1;
+        if (w->sorted && ret == 0) {
+            /* the meta data of tabix: the tbx_conf_t of the columns followed by the target names */
+            tbx_conf_t conf = {TBX_GENERIC, 1, 2, 2, '#', 0};
+            int32_t l_nm = 0;
+            for (int32_t i = 0; i < w->n_targets; ++i) l_nm += strlen(w->target_name[i]) + 1;
+            uint8_t *meta = malloc(28 + l_nm), *p = meta + 28;
+            memcpy(meta, &conf, 24);
+            memcpy(meta + 24, &l_nm, 4);
+            for (int32_t i = 0; i < w->n_targets; ++i) p = (uint8_t *) stpcpy((char *) p, w->target_name[i]) + 1;
+            hts_idx_amend_last(w->idx, bgzf_tell(w->fp));
+            if (hts_idx_finish(w->idx, bgzf_tell(w->fp)) < 0 || hts_idx_set_meta(w->idx, 28 + l_nm, meta, 0) < 0
+                || hts_idx_save_as(w->idx, w->fn, NULL, HTS_FMT_TBI) < 0) {
+                fprintf(stderr, "[tsv] failed to save the index of %s.\n", w->fn);
+                ret = -1;
+            }
+        }
+        if (bgzf_close(w->fp) < 0) ret = -1;
+        hts_idx_destroy(w->idx);
+        kh_destroy(tsv, w->tid);
+    } else {
+        if (tsv_flush(w, 0) < 0) ret = -1;
+        if (close(w->fd) < 0) ret = -1;
+    }
+    free(w->buf.s);
+    free(w->fn);
+    free(w);
+    return ret;
+}
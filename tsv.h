@@ -0,0 +1,49 @@
+/* The MIT License (MIT)
+
+   Copyright (c) 2023 Anrui Liu <liuar6@gmail.com>
+
+   Permission is hereby granted, free of charge, to any person obtaining
+   a copy of this software and associated documentation files (the
+   “Software”), to deal in the Software without restriction, including
+   without limitation the rights to use, copy, modify, merge, publish,
+   distribute, sublicense, and/or sell copies of the Software, and to
+   permit persons to whom the Software is furnished to do so, subject to
+   the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND,
+   EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+   NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+   BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+   ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE.
+ */
+
+/* writer of the tab separated output, the numbers are formatted by hand into a kstring_t, the lines are collected
+ * into a buffer written out with write(2) once it holds at least TSV_BUFFER_SIZE bytes. with tsv_bgzf(), the output
+ * is compressed into BGZF blocks by the threads of a mt_server, and a tabix index of the first two columns (target
+ * name and 1-based position) is built at the same time if the lines come in sorted order. */
+
+#ifndef SAMVT_TSV_H
+#define SAMVT_TSV_H
+
+#include <stdint.h>
+#include "htslib/kstring.h"
+#include "mt.h"
+
+#define TSV_BUFFER_SIZE (1u << 20u)
+
+int tsv_put_uint(kstring_t *s, uint64_t v);
+int tsv_put_count(kstring_t *s, double v, int integer);
+
+typedef struct tsv_s tsv_t;
+tsv_t *tsv_open(const char *fn);
+tsv_t *tsv_bgzf(tsv_t *w, mt_server *s, int32_t n_targets, char **target_name);
+int tsv_put(tsv_t *w, kstring_t *s);
+int tsv_close(tsv_t *w);
+
+#endif //SAMVT_TSV_H